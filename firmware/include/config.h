@@ -2,15 +2,20 @@
 #define CONFIG_H
 
 // EEPROM (or any form of sROM) config
-#define ADDRESS_WIDTH 16
+#define ADDRESS_WIDTH 16                         // 16 for 64KB parts, 17-20 for 27C010/020/040/080 (needs the third shift register stage), max 24
 #define WORD_SIZE 8
-#define MEMORY_SIZE 65536 // 2^16
+#define MEMORY_SIZE (1UL << ADDRESS_WIDTH)
+#define ADDRESS_BYTES ((ADDRESS_WIDTH + 7) / 8) // Cascaded 74HC595 stages, also the address field size of transfer.cpp blocks
 
 // System config
 #define SERIAL_BAUD_RATE 115200
 #define WAIT_FOR_SERIAL false            // If true, the program will not continue until a serial connection is established
-#define ADDRESS_ENDIANNESS LITTLE_ENDIAN // LITTLE_ENDIAN or BIG_ENDIAN
-#define DATA_ENDIANNESS LITTLE_ENDIAN    // LITTLE_ENDIAN or BIG_ENDIAN
+#define PROGRAM_BLOCK_SIZE 64            // Bytes buffered per block by the 'pb' command, the host sends one block then waits for a '.'
+#define ADDRESS_ENDIANNESS LITTLE_ENDIAN // LITTLE_ENDIAN or BIG_ENDIAN (A0 on the last shift register output instead of the first)
+#define DATA_ENDIANNESS LITTLE_ENDIAN    // LITTLE_ENDIAN or BIG_ENDIAN (D0 on DATA_BUS_PINS[7] instead of DATA_BUS_PINS[0])
+// Scrambled wiring (adapters, in-circuit), element n is the programmer line wired to the chip's An / Dn. Overrides the endianness
+// #define ADDRESS_LINE_MAP {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15} // Shift register outputs, ADDRESS_WIDTH entries
+// #define DATA_LINE_MAP {0, 1, 2, 3, 4, 5, 6, 7}                                 // DATA_BUS_PINS indexes, WORD_SIZE entries
 
 // Pin outs
 #define SR_CLOCK A2
@@ -23,13 +28,15 @@
 #define A9_HV_PIN 4
 #define OE_HV_PIN 3
 #define OE_LOGIC_VOLTAGE_PIN A4
+#define SRAM_WRITE_ENABLE A5 // SRAM /WE, only used by the RAM test ('mt'); the EPROM socket has no WE so the RAM adapter wires this
 
 const int DATA_BUS_PINS[WORD_SIZE] = {12, 11, 10, 9, 8, 7, 6, 5}; // 0 is LSB, 7 is MSB
 
 // Compile time options
 // #define STRICT_MODE // Causes the device to check the currently set mode before every operation (write, read, etc) - this is slow but useful for testing software on the sender's side
 //#define SLOW_MODE // Causes the device to use delays instead of microsecond delays - this is useful for debugging but the chip should be removed and instead LED's or similar used as indicators
-// #define BULK_TRANSFER_CODE // Include the code from transfer.cpp
+#define BULK_TRANSFER_CODE // Include the code from transfer.cpp (scatter program 'sp' and gather read 'gr' commands)
+// #define MEMORY_TEST_CODE // Include the SRAM march test engine from memtest.cpp ('mt' command), needs the RAM adapter
 
 // Meta settings
 #define VERSION "2.0.0"
@@ -40,6 +47,7 @@ const int DATA_BUS_PINS[WORD_SIZE] = {12, 11, 10, 9, 8, 7, 6, 5}; // 0 is LSB, 7
 #define SR_OE_ENABLE_LEVEL LOW       // Active low
 #define HV_ENABLE_LEVEL HIGH         // Active high
 #define MEMORY_CHIP_SELECT_LEVEL LOW // Active low
+#define SRAM_WRITE_ENABLE_LEVEL LOW  // Active low
 #endif                               // CONFIG_H
 
 #define DEVICE_READY_MESSAGE "RTR"
@@ -49,3 +57,4 @@ const int DATA_BUS_PINS[WORD_SIZE] = {12, 11, 10, 9, 8, 7, 6, 5}; // 0 is LSB, 7
 #define READ_DATA_MESSAGE "RD"
 #define END_DATA_MESSAGE "ED"
 #define ABORT_ACK_MESSAGE "ABT"
+#define DIAGNOSIS_MESSAGE "DG"
@@ -0,0 +1,66 @@
+#if !defined(MEMTEST_H)
+#define MEMTEST_H
+
+#include <Arduino.h>
+
+// On-device SRAM test engine (see memtest.cpp), used by the 'mt' command
+// Tests are march algorithms (a list of elements, each a sequence of reads/writes applied to every address
+// in one direction) combined with a data background pattern generator.
+
+#define MARCH_UP 0
+#define MARCH_DOWN 1
+#define MARCH_MAX_OPERATIONS 4
+
+// Operations: read or write the background pattern (0) or its complement (1)
+#define MARCH_R0 0
+#define MARCH_R1 1
+#define MARCH_W0 2
+#define MARCH_W1 3
+
+struct march_element
+{
+  uint8_t direction;
+  uint8_t operation_count;
+  uint8_t operations[MARCH_MAX_OPERATIONS];
+};
+
+// Returns the background pattern for an address, pass counts up from 0 to the test's pass count
+typedef byte (*pattern_generator_function)(uint32_t address, uint8_t pass);
+
+// Tables of these (and of march_element) are stored in PROGMEM
+struct memory_test
+{
+  const char *name; // PROGMEM string
+  const march_element *elements;
+  uint8_t element_count;
+  pattern_generator_function pattern;
+  uint8_t passes;
+};
+
+struct memory_test_result
+{
+  uint32_t faults;
+  uint32_t first_fault_address;
+  byte first_fault_expected;
+  byte first_fault_actual;
+  byte failing_bits; // OR of (expected ^ actual) over every fault
+  bool aborted;
+};
+
+uint8_t memory_test_count();
+const __FlashStringHelper *memory_test_name(uint8_t test); // Names are kept in flash, print them directly
+bool run_memory_test(uint8_t test, uint32_t size, memory_test_result *result);
+
+// Bus functions used by the engine, implemented in main.cpp
+void set_address(uint32_t address);
+void set_address_register_state(bool state);
+void set_data(byte data);
+byte parse_data_bits();
+void _read_data_bus();
+void _write_data_bus();
+void _set_data_bus_mode(bool io);
+void enable_memory(bool enabled);
+void set_OE_pin_state(int state);
+void set_A9_pin_state(int state);
+
+#endif // MEMTEST_H
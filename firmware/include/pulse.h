@@ -0,0 +1,19 @@
+#if !defined(PULSE_H)
+#define PULSE_H
+
+#include <Arduino.h>
+
+// Chip enable pulses timed by Timer1 (see pulse.cpp)
+// A pulse is started by driving MEMORY_CHIP_SELECT active and ended by the timer's compare match interrupt,
+// so the CPU is free to shift the next address into the (unlatched) shift registers while the pulse runs.
+// Widths are minimums: the end waits for the interrupt, so another ISR running at the time can stretch it by a few uS.
+// The hold is timed from the real end of the pulse, so it is a minimum too.
+// Anything that changes the bus (address latch, data bus, chip select) must call pulse_wait() first.
+
+void pulse_init();
+void pulse_start_us(uint16_t width, uint16_t hold); // width and hold (time after the pulse before the bus may change) in uS, max ~32ms total
+void pulse_start_ms(uint16_t width);                // width in mS, max ~4s (hold is one 64uS timer tick)
+bool pulse_active();
+void pulse_wait();
+
+#endif // PULSE_H
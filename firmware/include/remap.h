@@ -0,0 +1,36 @@
+#if !defined(REMAP_H)
+#define REMAP_H
+
+#include <Arduino.h>
+
+#include <constants.h>
+#include <config.h>
+
+// Address and data line remapping for scrambled wiring (in-circuit adapters, swapped lines, see remap.cpp)
+// Everything above the bus functions works in the chip's own bit order, so images are read and written
+// unscrambled. The permutation is applied through lookup tables built at compile time and kept in flash.
+// With straight wiring (the default) these are no-ops and no tables are compiled in.
+
+#if defined(ADDRESS_LINE_MAP) || ADDRESS_ENDIANNESS == BIG_ENDIAN
+#define ADDRESS_REMAP
+#endif
+
+#if defined(DATA_LINE_MAP) || DATA_ENDIANNESS == BIG_ENDIAN
+#define DATA_REMAP
+#endif
+
+#ifdef ADDRESS_REMAP
+uint32_t remap_address(uint32_t address); // Chip address -> shift register outputs
+#else
+inline uint32_t remap_address(uint32_t address) { return address; }
+#endif
+
+#ifdef DATA_REMAP
+byte remap_data(byte data);   // Chip data -> DATA_BUS_PINS order
+byte unmap_data(byte data);   // DATA_BUS_PINS order -> chip data
+#else
+inline byte remap_data(byte data) { return data; }
+inline byte unmap_data(byte data) { return data; }
+#endif
+
+#endif // REMAP_H
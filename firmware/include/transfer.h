@@ -0,0 +1,19 @@
+#if !defined(TRANSFER_H)
+#define TRANSFER_H
+
+#include <Arduino.h>
+
+#include <config.h>
+
+// Binary address/data block transfers (see transfer.cpp), used by the scatter program ('sp') and gather read ('gr') commands
+// A block is ADDRESS_BYTES of address (MSB first), one data byte and a checksum byte making the block sum to 0
+
+#define BLOCK_SIZE (ADDRESS_BYTES + 2) // Size of a single "packet" of data in bytes (address, data, checksum)
+#define BULK_BLOCK_COUNT 16            // Blocks buffered per batch (5 bytes of stack each), the host sends one batch then waits for its reply
+#define TRANSFER_TIMEOUT 1000          // mS to wait for each byte of a transfer
+#define TRANSFER_TIMEOUT_STATUS 0xFF   // bulk_transfer() status when the host stopped sending
+
+void single_block_transfer();
+uint8_t bulk_transfer(uint32_t address_array[], uint8_t data_array[], uint8_t count); // 0, the 1 based index of the first bad block or TRANSFER_TIMEOUT_STATUS
+
+#endif // TRANSFER_H
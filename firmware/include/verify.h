@@ -0,0 +1,42 @@
+#if !defined(VERIFY_H)
+#define VERIFY_H
+
+#include <Arduino.h>
+
+#include <config.h>
+
+// Verify statistics with early abort (see verify.cpp)
+// Every compared byte feeds a per data bit error histogram, mismatches are printed up to VERIFY_REPORT_LIMIT
+// and then only counted (with a per block total), and a stuck data line or dead part stops the verify early.
+
+#define VERIFY_REPORT_LIMIT 16   // Mismatch lines printed per verify, the rest are only counted
+#define VERIFY_BLOCK_SIZE 0x1000 // Failing blocks of this size get a failure count line
+#define VERIFY_MIN_SAMPLES 32    // A bit is stuck once it has been expected at a level this many times and never read back at it
+#define VERIFY_SUSPECT_SAMPLES 8 // Lower bar for the bits listed in the diagnosis (and for telling a dead part from one stuck line)
+#define VERIFY_DEAD_SAMPLES 256  // The part is dead if every one of this many bytes failed
+
+#define VERIFY_OK 0
+#define VERIFY_FAILED 1
+#define VERIFY_STUCK 2
+#define VERIFY_DEAD 3
+#define VERIFY_ABORTED 4
+
+struct verify_stats
+{
+  const char *tag; // Prefix of the mismatch lines, eg "PV"
+  uint32_t address; // Last address compared
+  uint32_t compared;
+  uint32_t failures;
+  uint32_t block_failures;
+  uint32_t expected_high[WORD_SIZE]; // Times each bit was expected to be 1
+  uint32_t expected_low[WORD_SIZE];
+  uint32_t low_failures[WORD_SIZE]; // Expected 1, read 0
+  uint32_t high_failures[WORD_SIZE]; // Expected 0, read 1
+  uint8_t verdict;
+};
+
+void verify_begin(verify_stats *stats, const char *tag);
+bool verify_byte(verify_stats *stats, uint32_t address, byte expected, byte actual); // False once the verify should stop
+void verify_end(verify_stats *stats);
+
+#endif // VERIFY_H
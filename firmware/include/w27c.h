@@ -3,6 +3,7 @@
 
 // Programing mode
 #define PROGRAM_CE_PULSE_WIDTH 100 // uS
+#define PROGRAM_DATA_HOLD_TIME 5 // uS (Tdh)
 
 // Erase mode
 #define ERASE_CE_PULSE_WIDTH 100 // mS
@@ -25,23 +25,36 @@ limitations under the License.
 #include <constants.h>
 #include <config.h>
 #include <w27c.h>
+#include <pulse.h>
+#include <memtest.h>
+#include <remap.h>
+#include <verify.h>
+#include <transfer.h>
 
 typedef CommandParser<10, 3, 10, 32, 64> MyCommandParser;
 
+#if ADDRESS_WIDTH > 24
+#error "ADDRESS_WIDTH above 24 bits is not supported"
+#endif
+
 MyCommandParser parser;
-uint16_t cmd_address;
+uint32_t cmd_address;
 uint8_t cmd_data;
 
 int bit = 0;
 boolean address_bits[ADDRESS_WIDTH] = {false};
 boolean data_bits[WORD_SIZE] = {false};
 
-uint32_t failures = 0;
-
 char serial_input_buffer[64];
 int serial_input_buffer_index = 0;
 char response[MyCommandParser::MAX_RESPONSE_SIZE];
 
+// Shift register data/clock port registers, see init_pins()
+volatile uint8_t *sr_data_port;
+uint8_t sr_data_mask;
+volatile uint8_t *sr_clock_port;
+uint8_t sr_clock_mask;
+
 #ifdef STRICT_MODE
 int state = 0;
 #endif
@@ -58,7 +71,7 @@ byte parse_data_bits()
   {
     response |= (data_bits[i] << i);
   }
-  return response;
+  return unmap_data(response);
 }
 
 // Bus manipulation functions
@@ -73,6 +86,7 @@ void _read_data_bus()
 
 void _write_data_bus()
 {
+  pulse_wait();
   for (int i = 0; i < WORD_SIZE; i++)
   {
     digitalWrite(DATA_BUS_PINS[i], data_bits[i]);
@@ -81,6 +95,7 @@ void _write_data_bus()
 
 void _set_data_bus_mode(bool io)
 {
+  pulse_wait();
   for (int i = 0; i < WORD_SIZE; i++)
   {
     pinMode(DATA_BUS_PINS[i], io ? INPUT : OUTPUT);
@@ -89,22 +104,60 @@ void _set_data_bus_mode(bool io)
 
 void set_data(byte data)
 {
+  data = remap_data(data);
   for (int i = 0; i < WORD_SIZE; i++)
   {
     data_bits[i] = (data >> i) & 1; // Get the bit at position i
   }
 }
 
-void set_address(uint16_t address)
+void shift_out_byte(byte value)
+{
+  // Same as shiftOut(SR_DATA, SR_CLOCK, MSBFIRST, value) but through the port registers, it runs for every
+  // address bit of every byte streamed so digitalWrite()'s overhead adds up (24 bits on the wider parts)
+  for (uint8_t mask = 0x80; mask != 0; mask >>= 1)
+  {
+    uint8_t oldSREG = SREG;
+    noInterrupts(); // The chip select pulse ISR may share a port
+    if (value & mask)
+    {
+      *sr_data_port |= sr_data_mask;
+    }
+    else
+    {
+      *sr_data_port &= ~sr_data_mask;
+    }
+    *sr_clock_port |= sr_clock_mask;
+    *sr_clock_port &= ~sr_clock_mask;
+    SREG = oldSREG;
+  }
+}
+
+void shift_address(uint32_t address)
 {
+  // Only loads the shift registers, the address outputs don't change until latch_address()
+  // so this is safe to do while a program pulse is running
   digitalWrite(SR_LATCH, LOW);
-  // digitalWrite(SR_CLOCK, LOW);
-  shiftOut(SR_DATA, SR_CLOCK, MSBFIRST, address >> 8);
-  // digitalWrite(SR_CLOCK, LOW);
-  shiftOut(SR_DATA, SR_CLOCK, MSBFIRST, address);
+  address = remap_address(address);
+  // Most significant stage first, it ends up at the far end of the cascade
+  for (int8_t stage = ADDRESS_BYTES - 1; stage >= 0; stage--)
+  {
+    shift_out_byte(address >> (8 * stage));
+  }
+}
+
+void latch_address()
+{
+  pulse_wait();
   digitalWrite(SR_LATCH, HIGH);
 }
 
+void set_address(uint32_t address)
+{
+  shift_address(address);
+  latch_address();
+}
+
 void reset_shift_register()
 {
   set_address_register_state(true);
@@ -120,6 +173,7 @@ void reset_shift_register()
 
 void enable_memory(bool enabled)
 {
+  pulse_wait();
   digitalWrite(MEMORY_CHIP_SELECT, enabled ? MEMORY_CHIP_SELECT_LEVEL : !MEMORY_CHIP_SELECT_LEVEL);
 }
 
@@ -226,6 +280,14 @@ void init_pins()
   pinMode(SR_LATCH, OUTPUT);
   pinMode(SR_OUTPUT_ENABLE, OUTPUT);
   pinMode(SR_MASTER_RESET, OUTPUT);
+#ifdef MEMORY_TEST_CODE
+  pinMode(SRAM_WRITE_ENABLE, OUTPUT);
+  digitalWrite(SRAM_WRITE_ENABLE, !SRAM_WRITE_ENABLE_LEVEL);
+#endif
+  sr_data_port = portOutputRegister(digitalPinToPort(SR_DATA));
+  sr_data_mask = digitalPinToBitMask(SR_DATA);
+  sr_clock_port = portOutputRegister(digitalPinToPort(SR_CLOCK));
+  sr_clock_mask = digitalPinToBitMask(SR_CLOCK);
   for (int i = 0; i < WORD_SIZE; i++)
   {
     // Put the data pins into INPUT mode by default (high impedance, prevents bus contention during setup)
@@ -241,7 +303,7 @@ void init_pins()
   digitalWrite(SR_MASTER_RESET, HIGH);
 }
 
-void write_byte(uint16_t address, byte data)
+void write_byte(uint32_t address, byte data)
 {
 // must call start_program_cycle() before calling this function!!
 #ifdef STRICT_MODE
@@ -251,21 +313,21 @@ void write_byte(uint16_t address, byte data)
     return;
   }
 #endif
-  set_address(address);
+  // The previous byte's pulse may still be running, loading the next address into the shift registers
+  // overlaps with it. Returns as soon as this byte's pulse has started (Timer1 ends it, see pulse.cpp)
+  shift_address(address);
   set_data(data);
+  latch_address();
   _write_data_bus();
   delayMicroseconds(3);
-  enable_memory(true);
 #ifdef SLOW_MODE
-  delay(PROGRAM_CE_PULSE_WIDTH);
+  pulse_start_ms(PROGRAM_CE_PULSE_WIDTH);
 #else
-  delayMicroseconds(PROGRAM_CE_PULSE_WIDTH);
+  pulse_start_us(PROGRAM_CE_PULSE_WIDTH, PROGRAM_DATA_HOLD_TIME);
 #endif
-  enable_memory(false);
-  delayMicroseconds(5); // Tdh
 }
 
-void read_byte(uint16_t address)
+void read_byte(uint32_t address)
 {
 // must call start_read_cycle() before calling this function!!
 #ifdef STRICT_MODE
@@ -294,14 +356,14 @@ void read_byte(uint16_t address)
   // set_address_register_state(false);
 }
 
-void print_hex(uint16_t number)
+void print_hex(uint32_t number)
 {
-  sprintf(response, "%X", number);
+  sprintf(response, "%lX", (unsigned long)number);
   Serial.print("0x");
   Serial.print(response);
 }
 
-void read_byte_erase_verify(uint16_t address)
+void read_byte_erase_verify(uint32_t address)
 {
   set_address(address);
   set_OE_pin_state(LOW);
@@ -344,10 +406,8 @@ bool erase_chip(int max_attempts)
     set_data(0xFF);
     _write_data_bus();
     delay(1000);
-    enable_memory(true);
-    delay(ERASE_CE_PULSE_WIDTH);
-    enable_memory(false);
-    delayMicroseconds(5);
+    pulse_start_ms(ERASE_CE_PULSE_WIDTH);
+    pulse_wait();
     _set_data_bus_mode(true);
     set_OE_pin_state(HIGH);
     set_A9_pin_state(LOW);
@@ -415,7 +475,7 @@ bool erase_chip(int max_attempts)
   return erase_verified;
 }
 
-byte pattern_generator(uint16_t address)
+byte pattern_generator(uint32_t address)
 {
   return (address >> 8) & 0xFF;
 }
@@ -449,8 +509,8 @@ void cmd_set_mode(MyCommandParser::Argument *args, char *response)
 
 void cmd_dump_contents(MyCommandParser::Argument *args, char *response)
 {
-  uint16_t start_address = args[0].asInt64;
-  uint16_t end_address = args[1].asInt64;
+  uint32_t start_address = args[0].asInt64;
+  uint32_t end_address = args[1].asInt64;
   if (start_address > end_address || end_address > MEMORY_SIZE || start_address > MEMORY_SIZE)
   {
     strcpy(response, NACK_MESSAGE);
@@ -490,7 +550,7 @@ void cmd_dump_contents(MyCommandParser::Argument *args, char *response)
   strcpy(response, DEVICE_READY_MESSAGE);
 }
 
-void write_block(uint16_t address, uint8_t *buffer, uint8_t length) {
+void write_block(uint32_t address, uint8_t *buffer, uint8_t length) {
   for (uint8_t i = 0; i < length; i++) {
     write_byte(address + i, buffer[i]);
   }
@@ -503,23 +563,26 @@ void cmd_program_block(MyCommandParser::Argument *args, char *response)
   // Once we reach the end address, read the data back and send over serial
   start_program_cycle();
   Serial.println(SEND_DATA_MESSAGE);
-  uint16_t start_address = args[0].asInt64;
-  uint16_t end_address = args[1].asInt64;
-  uint8_t buffer[64] = {0};
+  uint32_t start_address = args[0].asInt64;
+  uint32_t end_address = args[1].asInt64;
+  uint8_t buffer[PROGRAM_BLOCK_SIZE] = {0};
   for (cmd_address = start_address; cmd_address < end_address; cmd_address++)
   {
     while (!Serial.available())
     {
     } // Wait for data
-    buffer[cmd_address % 64] = Serial.read();
-    if (cmd_address % 64 == 63)
+    buffer[cmd_address % PROGRAM_BLOCK_SIZE] = Serial.read();
+    if (cmd_address % PROGRAM_BLOCK_SIZE == PROGRAM_BLOCK_SIZE - 1 || cmd_address == end_address - 1)
     {
-      write_block(cmd_address - 63, buffer, 64);
+      // Blocks are aligned to PROGRAM_BLOCK_SIZE, the first one may start part way in (only the bytes received are written)
+      uint32_t block_start = max(cmd_address - cmd_address % PROGRAM_BLOCK_SIZE, start_address);
+      write_block(block_start, buffer + block_start % PROGRAM_BLOCK_SIZE, cmd_address - block_start + 1);
+      if (cmd_address == end_address - 1)
+      {
+        Serial.println(".");
+        break;
+      }
       Serial.print(".");
-    } else if (cmd_address == end_address - 1) {
-      write_block(cmd_address - (cmd_address % 64), buffer, cmd_address % 64 + 1);
-      Serial.println(".");
-      break;
     }
   }
   delay(10);
@@ -540,6 +603,15 @@ void cmd_program_block(MyCommandParser::Argument *args, char *response)
     read_byte(cmd_address);
     readback_data = parse_data_bits();
     Serial.write(readback_data);
+    // The host compares as the data arrives and sends a 'q' once it has seen enough (eg a stuck data line)
+    if (cmd_address % 128 == 0 && Serial.available() && Serial.read() == 'q')
+    {
+      Serial.println();
+      Serial.println(ABORT_ACK_MESSAGE);
+      end_read_cycle();
+      strcpy(response, DEVICE_READY_MESSAGE);
+      return;
+    }
   }
   delay(1);
   Serial.println();
@@ -552,8 +624,9 @@ void cmd_program_test_pattern(MyCommandParser::Argument *args, char *response)
 {
   // Creates a "test pattern" (binary upcount) up to the address specifed by argument 0
   // and programs this to the ROM; then reads it back and prints any errors. Assumes an erased ROM!
-  uint16_t end_address = args[0].asUInt64;
+  uint32_t end_address = args[0].asUInt64;
   byte read_back_data = 0x00;
+  verify_stats stats;
   Serial.print("Program test pattern up to ");
   print_hex(end_address);
   Serial.println("; confirm & 12v on Vpp? (y/n)");
@@ -586,7 +659,7 @@ void cmd_program_test_pattern(MyCommandParser::Argument *args, char *response)
     set_address_register_state(true);
     enable_memory(true);
 
-    failures = 0;
+    verify_begin(&stats, "PV");
     for (cmd_address = 0; cmd_address < end_address; cmd_address++)
     {
       cmd_data = pattern_generator(cmd_address);
@@ -595,51 +668,41 @@ void cmd_program_test_pattern(MyCommandParser::Argument *args, char *response)
       delayMicroseconds(10);
       _read_data_bus();
       read_back_data = parse_data_bits();
-      if (cmd_data != read_back_data)
+      if (!verify_byte(&stats, cmd_address, cmd_data, read_back_data))
       {
-        Serial.print("(PV) addr: ");
-        print_hex(cmd_address);
-        Serial.print(" expected ");
-        print_hex(cmd_data);
-        Serial.print(" got ");
-        print_hex(read_back_data);
-        Serial.println();
-        failures += 1;
+        break;
       }
-      else if (cmd_address % 0x1000 == 0)
+      if (cmd_address % 0x1000 == 0)
       {
         Serial.print("(PV): ");
         print_hex(cmd_address);
         Serial.println();
       }
     }
-    Serial.print("PV done ");
-    Serial.print(failures, DEC);
-    Serial.println(" fails");
+    verify_end(&stats);
     enable_memory(false);
     set_address(0);
     set_address_register_state(false);
     set_OE_pin_state(HIGH);
+    if (stats.verdict > VERIFY_FAILED)
+    {
+      // A stuck data line or dead part fails the read-verify the same way, don't wait for it
+      strcpy(response, "Test pattern failed");
+      return;
+    }
     Serial.println("PV done, starting read-verify");
     start_read_cycle();
-    failures = 0;
+    verify_begin(&stats, "RB");
     for (cmd_address = 0; cmd_address < end_address; cmd_address++)
     {
       cmd_data = pattern_generator(cmd_address);
       read_byte(cmd_address);
       read_back_data = parse_data_bits();
-      if (cmd_data != read_back_data)
+      if (!verify_byte(&stats, cmd_address, cmd_data, read_back_data))
       {
-        Serial.print("(RB) addr: ");
-        print_hex(cmd_address);
-        Serial.print(" expected ");
-        print_hex(cmd_data);
-        Serial.print(" got ");
-        print_hex(read_back_data);
-        Serial.println();
-        failures += 1;
+        break;
       }
-      else if (cmd_address % 0x1000 == 0)
+      if (cmd_address % 0x1000 == 0)
       {
         Serial.print("(RB): ");
         print_hex(cmd_address);
@@ -647,9 +710,12 @@ void cmd_program_test_pattern(MyCommandParser::Argument *args, char *response)
       }
     }
     end_read_cycle();
-    Serial.print("RB done ");
-    Serial.print(failures, DEC);
-    Serial.println(" fails");
+    verify_end(&stats);
+    if (stats.verdict != VERIFY_OK)
+    {
+      strcpy(response, "Test pattern failed");
+      return;
+    }
     strcpy(response, "Test pattern complete");
   }
   else
@@ -687,12 +753,128 @@ void cmd_program_byte(MyCommandParser::Argument *args, char *response)
   cmd_address = args[0].asUInt64;
   cmd_data = args[1].asUInt64;
   write_byte(cmd_address, cmd_data);
-  sprintf(response, "%x: %x", cmd_address, cmd_data);
+  sprintf(response, "%lx: %x", (unsigned long)cmd_address, cmd_data);
+}
+
+#ifdef MEMORY_TEST_CODE
+void cmd_memory_test(MyCommandParser::Argument *args, char *response)
+{
+  // Runs SRAM march test args[0] (1 based, 0 runs every test) over the first args[1] bytes of the part
+  // Prints one summary line per test, 'q' aborts. Requires a RAM adapter with /WE wired to SRAM_WRITE_ENABLE
+  uint8_t selected = args[0].asUInt64;
+  uint32_t size = args[1].asUInt64;
+  memory_test_result result;
+  bool passed = true;
+  if (selected > memory_test_count() || size == 0 || size > MEMORY_SIZE)
+  {
+    strcpy(response, NACK_MESSAGE);
+    return;
+  }
+  for (uint8_t test = 0; test < memory_test_count(); test++)
+  {
+    if (selected != 0 && test != selected - 1)
+    {
+      continue;
+    }
+    Serial.print(F("(MT) "));
+    Serial.print(memory_test_name(test));
+    Serial.print(F(": "));
+    if (run_memory_test(test, size, &result))
+    {
+      Serial.println(F("pass"));
+      continue;
+    }
+    passed = false;
+    if (result.aborted)
+    {
+      Serial.println(F("aborted"));
+      Serial.println(ABORT_ACK_MESSAGE);
+      break;
+    }
+    Serial.print(result.faults, DEC);
+    Serial.print(F(" faults, first "));
+    print_hex(result.first_fault_address);
+    Serial.print(F(" expected "));
+    print_hex(result.first_fault_expected);
+    Serial.print(F(" got "));
+    print_hex(result.first_fault_actual);
+    Serial.print(F(" bits "));
+    print_hex(result.failing_bits);
+    Serial.println();
+  }
+  strcpy(response, passed ? ACK_MESSAGE : NACK_MESSAGE);
 }
+#endif
+
+#ifdef BULK_TRANSFER_CODE
+void scatter_gather(uint32_t count, bool program, char *response)
+{
+  // Receives count address/data blocks (see transfer.h) in batches of up to BULK_BLOCK_COUNT. For each batch:
+  // host -> device: the blocks
+  // device -> host: a status byte (0 or the bulk_transfer() error), then if 0 the byte read back from every
+  // block's address (after programming its data for 'sp') followed by a checksum byte making them sum to 0
+  // The batch lives on the stack, like the 'pb' buffer, so it only takes RAM while the command runs
+  uint32_t bulk_addresses[BULK_BLOCK_COUNT];
+  uint8_t bulk_data[BULK_BLOCK_COUNT];
+  Serial.println(SEND_DATA_MESSAGE);
+  while (count > 0)
+  {
+    uint8_t batch = count < BULK_BLOCK_COUNT ? count : BULK_BLOCK_COUNT;
+    uint8_t status = bulk_transfer(bulk_addresses, bulk_data, batch);
+    Serial.write(status);
+    if (status != 0)
+    {
+      while (Serial.available())
+      {
+        Serial.read();
+      }
+      Serial.println();
+      strcpy(response, NACK_MESSAGE);
+      return;
+    }
+    if (program)
+    {
+      start_program_cycle();
+      for (uint8_t i = 0; i < batch; i++)
+      {
+        write_byte(bulk_addresses[i], bulk_data[i]);
+      }
+      end_program_cycle();
+    }
+    byte checksum = 0;
+    start_read_cycle();
+    for (uint8_t i = 0; i < batch; i++)
+    {
+      read_byte(bulk_addresses[i]);
+      cmd_data = parse_data_bits();
+      Serial.write(cmd_data);
+      checksum += cmd_data;
+    }
+    end_read_cycle();
+    Serial.write((byte)-checksum);
+    count -= batch;
+  }
+  Serial.println();
+  strcpy(response, ACK_MESSAGE);
+}
+
+void cmd_scatter_program(MyCommandParser::Argument *args, char *response)
+{
+  // Programs args[0] (address, data) blocks at arbitrary addresses, replies with the read-back of each
+  scatter_gather(args[0].asUInt64, true, response);
+}
+
+void cmd_gather_read(MyCommandParser::Argument *args, char *response)
+{
+  // Reads args[0] arbitrary addresses (the data byte of each block is ignored)
+  scatter_gather(args[0].asUInt64, false, response);
+}
+#endif
 
 void setup()
 {
   init_pins();
+  pulse_init();
   reset_shift_register();
   delay(1);
   Serial.begin(SERIAL_BAUD_RATE);
@@ -705,6 +887,13 @@ void setup()
   parser.registerCommand("pb", "uu", cmd_program_block);
   parser.registerCommand("p", "uu", cmd_program_byte);
   parser.registerCommand("dc", "uu", cmd_dump_contents);
+#ifdef MEMORY_TEST_CODE
+  parser.registerCommand("mt", "uu", cmd_memory_test);
+#endif
+#ifdef BULK_TRANSFER_CODE
+  parser.registerCommand("sp", "u", cmd_scatter_program);
+  parser.registerCommand("gr", "u", cmd_gather_read);
+#endif
 }
 
 void loop()
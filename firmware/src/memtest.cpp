@@ -0,0 +1,191 @@
+#include <config.h>
+
+#ifdef MEMORY_TEST_CODE
+// SRAM qualification: march tests run entirely on the device, only a fault summary goes back over serial
+// Chip enable is held active for the whole test, reads are OE controlled and writes WE controlled.
+// OE is only ever driven to logic levels here, never to Vpp.
+#include <Arduino.h>
+
+#include <constants.h>
+#include <memtest.h>
+
+// Background pattern generators, add new ones here and reference them from memory_tests below
+
+byte solid_background(uint32_t address, uint8_t pass)
+{
+  // With their complements these cover coupling between every pair of bits within a word
+  static const byte backgrounds[] PROGMEM = {0x00, 0x55, 0x33, 0x0F};
+  return pgm_read_byte(&backgrounds[pass]);
+}
+
+byte checkerboard_background(uint32_t address, uint8_t pass)
+{
+  // Alternates between neighbouring addresses in both the low (column) and high (row) address byte
+  return ((address ^ (address >> 8)) & 1) ? 0xAA : 0x55;
+}
+
+byte walking_ones_background(uint32_t address, uint8_t pass)
+{
+  return 1 << pass;
+}
+
+byte address_in_address_background(uint32_t address, uint8_t pass)
+{
+  // One pass per address byte, shorted or open address lines alias two addresses onto the same cell
+  return address >> (8 * pass);
+}
+
+// March algorithms, the tables (and test names) live in flash and are copied out with memcpy_P as they are used
+
+// March C-: {up(w0); up(r0,w1); up(r1,w0); down(r0,w1); down(r1,w0); up(r0)}
+const march_element march_c_minus[] PROGMEM = {
+    {MARCH_UP, 1, {MARCH_W0}},
+    {MARCH_UP, 2, {MARCH_R0, MARCH_W1}},
+    {MARCH_UP, 2, {MARCH_R1, MARCH_W0}},
+    {MARCH_DOWN, 2, {MARCH_R0, MARCH_W1}},
+    {MARCH_DOWN, 2, {MARCH_R1, MARCH_W0}},
+    {MARCH_UP, 1, {MARCH_R0}},
+};
+
+// MATS+: {up(w0); up(r0,w1); down(r1,w0)}
+const march_element mats_plus[] PROGMEM = {
+    {MARCH_UP, 1, {MARCH_W0}},
+    {MARCH_UP, 2, {MARCH_R0, MARCH_W1}},
+    {MARCH_DOWN, 2, {MARCH_R1, MARCH_W0}},
+};
+
+// {up(w0); up(r0)}
+const march_element write_read[] PROGMEM = {
+    {MARCH_UP, 1, {MARCH_W0}},
+    {MARCH_UP, 1, {MARCH_R0}},
+};
+
+const char march_c_minus_name[] PROGMEM = "March C-";
+const char checkerboard_name[] PROGMEM = "Checkerboard";
+const char walking_ones_name[] PROGMEM = "Walking ones";
+const char address_in_address_name[] PROGMEM = "Address in address";
+
+const memory_test memory_tests[] PROGMEM = {
+    {march_c_minus_name, march_c_minus, sizeof(march_c_minus) / sizeof(march_element), solid_background, 4},
+    {checkerboard_name, mats_plus, sizeof(mats_plus) / sizeof(march_element), checkerboard_background, 1},
+    {walking_ones_name, write_read, sizeof(write_read) / sizeof(march_element), walking_ones_background, WORD_SIZE},
+    {address_in_address_name, write_read, sizeof(write_read) / sizeof(march_element), address_in_address_background, ADDRESS_BYTES},
+};
+
+bool sram_bus_is_input = true;
+
+void sram_bus_mode(bool input)
+{
+  // Switching the bus direction is 8 pinMode() calls, skip it when consecutive operations agree
+  if (input != sram_bus_is_input)
+  {
+    _set_data_bus_mode(input);
+    sram_bus_is_input = input;
+  }
+}
+
+void start_sram_cycle()
+{
+  enable_memory(false);
+  set_A9_pin_state(LOW);
+  set_OE_pin_state(HIGH);
+  digitalWrite(SRAM_WRITE_ENABLE, !SRAM_WRITE_ENABLE_LEVEL);
+  _set_data_bus_mode(true);
+  sram_bus_is_input = true;
+  set_address_register_state(true);
+  enable_memory(true);
+}
+
+void end_sram_cycle()
+{
+  enable_memory(false);
+  digitalWrite(SRAM_WRITE_ENABLE, !SRAM_WRITE_ENABLE_LEVEL);
+  set_OE_pin_state(HIGH);
+  _set_data_bus_mode(true);
+  sram_bus_is_input = true;
+  set_address_register_state(false);
+}
+
+byte sram_read()
+{
+  sram_bus_mode(true);
+  set_OE_pin_state(LOW);
+  _read_data_bus();
+  set_OE_pin_state(HIGH);
+  return parse_data_bits();
+}
+
+void sram_write(byte data)
+{
+  sram_bus_mode(false);
+  set_data(data);
+  _write_data_bus();
+  digitalWrite(SRAM_WRITE_ENABLE, SRAM_WRITE_ENABLE_LEVEL);
+  digitalWrite(SRAM_WRITE_ENABLE, !SRAM_WRITE_ENABLE_LEVEL);
+}
+
+uint8_t memory_test_count()
+{
+  return sizeof(memory_tests) / sizeof(memory_test);
+}
+
+const __FlashStringHelper *memory_test_name(uint8_t test)
+{
+  return reinterpret_cast<const __FlashStringHelper *>(pgm_read_ptr(&memory_tests[test].name));
+}
+
+bool run_memory_test(uint8_t test, uint32_t size, memory_test_result *result)
+{
+  memory_test selected;
+  march_element element;
+  memcpy_P(&selected, &memory_tests[test], sizeof(selected));
+  result->faults = 0;
+  result->failing_bits = 0;
+  result->aborted = false;
+
+  start_sram_cycle();
+  for (uint8_t pass = 0; pass < selected.passes; pass++)
+  {
+    for (uint8_t element_index = 0; element_index < selected.element_count; element_index++)
+    {
+      memcpy_P(&element, &selected.elements[element_index], sizeof(element));
+      for (uint32_t i = 0; i < size; i++)
+      {
+        uint32_t address = element.direction == MARCH_UP ? i : size - 1 - i;
+        byte background = selected.pattern(address, pass);
+        set_address(address);
+        for (uint8_t operation_index = 0; operation_index < element.operation_count; operation_index++)
+        {
+          uint8_t operation = element.operations[operation_index];
+          byte expected = (operation == MARCH_R1 || operation == MARCH_W1) ? ~background : background;
+          if (operation == MARCH_W0 || operation == MARCH_W1)
+          {
+            sram_write(expected);
+            continue;
+          }
+          byte actual = sram_read();
+          if (actual != expected)
+          {
+            if (result->faults == 0)
+            {
+              result->first_fault_address = address;
+              result->first_fault_expected = expected;
+              result->first_fault_actual = actual;
+            }
+            result->faults++;
+            result->failing_bits |= expected ^ actual;
+          }
+        }
+      }
+      if (Serial.available() && Serial.read() == 'q')
+      {
+        result->aborted = true;
+        end_sram_cycle();
+        return false;
+      }
+    }
+  }
+  end_sram_cycle();
+  return result->faults == 0;
+}
+#endif
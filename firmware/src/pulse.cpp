@@ -0,0 +1,112 @@
+// Hardware timed chip enable pulses
+// Timer1 runs in normal mode for one pulse at a time: chip select goes active as the timer is started,
+// compare match A ends the pulse and compare match B ends the hold time and stops the timer.
+// Only the start of the pulse is exact: the end is whenever TIMER1_COMPA_vect gets to run, which is late by the
+// ISR entry plus any interrupt (UART, Timer0/millis()) already running at the match, ie a few uS at worst.
+// That bounds the stretch, where delayMicroseconds() was stretched by every interrupt during the whole pulse.
+// Compare match B is only set up once the pulse has really ended, so a late end never eats into the hold.
+// Chip select is driven through its port register, in the ISR this is the only thing that takes time.
+#include <Arduino.h>
+#include <avr/interrupt.h>
+
+#include <config.h>
+#include <pulse.h>
+
+#define PRESCALER_8 _BV(CS11)               // 0.5uS per tick at 16MHz
+#define PRESCALER_1024 (_BV(CS12) | _BV(CS10)) // 64uS per tick at 16MHz
+
+volatile uint8_t *chip_select_port;
+uint8_t chip_select_mask = 0;
+volatile bool pulse_running = false;
+volatile uint16_t pulse_hold_ticks = 0;
+
+inline void chip_select_active()
+{
+#if MEMORY_CHIP_SELECT_LEVEL == LOW
+  *chip_select_port &= ~chip_select_mask;
+#else
+  *chip_select_port |= chip_select_mask;
+#endif
+}
+
+inline void chip_select_inactive()
+{
+#if MEMORY_CHIP_SELECT_LEVEL == LOW
+  *chip_select_port |= chip_select_mask;
+#else
+  *chip_select_port &= ~chip_select_mask;
+#endif
+}
+
+void pulse_init()
+{
+  chip_select_port = portOutputRegister(digitalPinToPort(MEMORY_CHIP_SELECT));
+  chip_select_mask = digitalPinToBitMask(MEMORY_CHIP_SELECT);
+  // The Arduino core sets Timer1 up for PWM, we only want it as a one-shot
+  noInterrupts();
+  TCCR1A = 0;
+  TCCR1B = 0;
+  TIMSK1 = 0;
+  interrupts();
+}
+
+void pulse_start(uint16_t width_ticks, uint16_t hold_ticks, uint8_t clock_select)
+{
+  pulse_wait();
+  if (width_ticks == 0)
+  {
+    width_ticks = 1;
+  }
+  noInterrupts();
+  TCNT1 = 0;
+  OCR1A = width_ticks;
+  pulse_hold_ticks = hold_ticks;
+  TIFR1 = _BV(OCF1A); // Clear any stale match
+  TIMSK1 = _BV(OCIE1A);
+  pulse_running = true;
+  // Chip select and the timer start back to back with interrupts off so the start is exact to the cycle,
+  // the end can still be a few uS late (see the top of this file)
+  chip_select_active();
+  TCCR1B = clock_select;
+  interrupts();
+}
+
+void pulse_start_us(uint16_t width, uint16_t hold)
+{
+  uint32_t ticks_per_us = F_CPU / 8 / 1000000UL;
+  pulse_start(width * ticks_per_us, (hold > 0 ? hold : 1) * ticks_per_us, PRESCALER_8);
+}
+
+void pulse_start_ms(uint16_t width)
+{
+  pulse_start((uint32_t)width * (F_CPU / 1024) / 1000, 1, PRESCALER_1024);
+}
+
+bool pulse_active()
+{
+  return pulse_running;
+}
+
+void pulse_wait()
+{
+  while (pulse_running)
+  {
+  }
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+  // End of the pulse, the bus stays put until the hold time (counted from now) is up
+  // +1 so the match isn't missed if the timer ticks over while OCR1B is being written
+  chip_select_inactive();
+  OCR1B = TCNT1 + pulse_hold_ticks + 1;
+  TIFR1 = _BV(OCF1B);
+  TIMSK1 = _BV(OCIE1B);
+}
+
+ISR(TIMER1_COMPB_vect)
+{
+  TCCR1B = 0;
+  TIMSK1 = 0;
+  pulse_running = false;
+}
@@ -0,0 +1,107 @@
+// Lookup tables for the address and data line permutations (see remap.h)
+// Each table entry is computed by a constexpr function, the LUT_* macros expand one call per entry so the
+// tables are plain constant data in flash. The address is remapped one byte at a time: every shift register
+// stage has its own 256 entry table giving that byte's contribution to the scrambled address, the results are
+// ORed together. Remapping costs ADDRESS_BYTES table reads per address and one per data byte.
+#include <Arduino.h>
+#include <avr/pgmspace.h>
+
+#include <remap.h>
+
+#define LUT_4(f, stage, n) f(stage, n), f(stage, n + 1), f(stage, n + 2), f(stage, n + 3)
+#define LUT_16(f, stage, n) LUT_4(f, stage, n), LUT_4(f, stage, n + 4), LUT_4(f, stage, n + 8), LUT_4(f, stage, n + 12)
+#define LUT_64(f, stage, n) LUT_16(f, stage, n), LUT_16(f, stage, n + 16), LUT_16(f, stage, n + 32), LUT_16(f, stage, n + 48)
+#define LUT_256(f, stage) LUT_64(f, stage, 0), LUT_64(f, stage, 64), LUT_64(f, stage, 128), LUT_64(f, stage, 192)
+
+// Line n of the chip -> line of the programmer (shift register output or DATA_BUS_PINS index)
+#if defined(ADDRESS_LINE_MAP)
+constexpr uint8_t address_line_map[ADDRESS_WIDTH] = ADDRESS_LINE_MAP;
+constexpr uint8_t address_line(uint8_t line) { return address_line_map[line]; }
+#else
+constexpr uint8_t address_line(uint8_t line) { return ADDRESS_ENDIANNESS == BIG_ENDIAN ? ADDRESS_WIDTH - 1 - line : line; }
+#endif
+
+#if defined(DATA_LINE_MAP)
+constexpr uint8_t data_line_map[WORD_SIZE] = DATA_LINE_MAP;
+constexpr uint8_t data_line(uint8_t line) { return data_line_map[line]; }
+#else
+constexpr uint8_t data_line(uint8_t line) { return DATA_ENDIANNESS == BIG_ENDIAN ? WORD_SIZE - 1 - line : line; }
+#endif
+
+// Every programmer line used exactly once <=> the lines cover all width bits
+constexpr uint32_t address_line_mask(uint8_t count)
+{
+  return count == 0 ? 0 : (1UL << address_line(count - 1)) | address_line_mask(count - 1);
+}
+
+constexpr uint32_t data_line_mask(uint8_t count)
+{
+  return count == 0 ? 0 : (1UL << data_line(count - 1)) | data_line_mask(count - 1);
+}
+
+static_assert(address_line_mask(ADDRESS_WIDTH) == (1UL << ADDRESS_WIDTH) - 1, "ADDRESS_LINE_MAP must be a permutation of 0..ADDRESS_WIDTH-1");
+static_assert(data_line_mask(WORD_SIZE) == (1UL << WORD_SIZE) - 1, "DATA_LINE_MAP must be a permutation of 0..WORD_SIZE-1");
+
+#ifdef ADDRESS_REMAP
+#if ADDRESS_WIDTH <= 16
+typedef uint16_t address_lut_entry;
+#define read_address_lut(entry) pgm_read_word(entry)
+#else
+typedef uint32_t address_lut_entry;
+#define read_address_lut(entry) pgm_read_dword(entry)
+#endif
+
+// Scrambled address bits for value placed in address byte stage (bit 0 of stage 1 is A8 and so on)
+constexpr address_lut_entry address_lut_value(uint8_t stage, uint16_t value, uint8_t bit = 0)
+{
+  return bit == 8 ? 0
+                  : ((value >> bit) & 1 && 8 * stage + bit < ADDRESS_WIDTH ? (address_lut_entry)1 << address_line(8 * stage + bit) : 0) |
+                        address_lut_value(stage, value, bit + 1);
+}
+
+const address_lut_entry address_lut[ADDRESS_BYTES][256] PROGMEM = {
+    {LUT_256(address_lut_value, 0)},
+#if ADDRESS_BYTES > 1
+    {LUT_256(address_lut_value, 1)},
+#endif
+#if ADDRESS_BYTES > 2
+    {LUT_256(address_lut_value, 2)},
+#endif
+};
+
+uint32_t remap_address(uint32_t address)
+{
+  uint32_t scrambled = 0;
+  for (uint8_t stage = 0; stage < ADDRESS_BYTES; stage++)
+  {
+    scrambled |= read_address_lut(&address_lut[stage][(address >> (8 * stage)) & 0xFF]);
+  }
+  return scrambled;
+}
+#endif
+
+#ifdef DATA_REMAP
+// stage is unused, it keeps the entry functions compatible with the LUT_* macros
+constexpr byte data_lut_value(uint8_t stage, uint16_t value, uint8_t line = 0)
+{
+  return line == WORD_SIZE ? 0 : (((value >> line) & 1) << data_line(line)) | data_lut_value(stage, value, line + 1);
+}
+
+constexpr byte data_rlut_value(uint8_t stage, uint16_t value, uint8_t line = 0)
+{
+  return line == WORD_SIZE ? 0 : (((value >> data_line(line)) & 1) << line) | data_rlut_value(stage, value, line + 1);
+}
+
+const byte data_lut[256] PROGMEM = {LUT_256(data_lut_value, 0)};
+const byte data_rlut[256] PROGMEM = {LUT_256(data_rlut_value, 0)};
+
+byte remap_data(byte data)
+{
+  return pgm_read_byte(&data_lut[data]);
+}
+
+byte unmap_data(byte data)
+{
+  return pgm_read_byte(&data_rlut[data]);
+}
+#endif
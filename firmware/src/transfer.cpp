@@ -5,31 +5,59 @@
 // This includes "one off" (eg read single byte) as well as bulk (eg write file to ROM) transfers
 #include <Arduino.h>
 
-#define BLOCK_SIZE 4       // Size of a single "packet" of data in bytes
-#define BULK_BLOCK_COUNT 8 // The number of back-to-back blocks expected in bulk transfer
-#define BULK_BYTE_SIZE BULK_BLOCK_COUNT *BLOCK_SIZE
+#include <transfer.h>
 
 byte block_buffer[BLOCK_SIZE] = {0x00};
-byte bulk_transfer_buffer[BULK_BYTE_SIZE] = {0x00};
 
 uint16_t transfer_state = 0; // 0 - IDLE, 1 - awaiting single block, 2 - awaitng next block (bulk), 3 - reading byte, 4 - awaiting next byte, 5 - processing block, 10 - error condition
-// 16 bit address
-uint16_t address_registerA = 0x0000;
-uint16_t address_registerB = 0x0000;
+// Up to 24 bit address (ADDRESS_BYTES bytes on the wire, MSB first)
+uint32_t address_registerA = 0x0000;
+uint32_t address_registerB = 0x0000;
 // We only support 8-bit data/word width
 uint8_t data_registerA = 0x00;
 uint8_t data_registerB = 0x00;
 
-byte checksum_register = 0x00;
+void combine_bytes(uint32_t *output, byte *bytes)
+{
+    // bytes[0] is the most significant of ADDRESS_BYTES bytes
+    *output = 0;
+    for (int byte_index = 0; byte_index < ADDRESS_BYTES; byte_index++)
+    {
+        *output = (*output << 8) | bytes[byte_index];
+    }
+}
 
-void combine_bytes(uint16_t *output, byte high, byte low)
+int read_transfer_byte()
 {
-    *output = high;         // MSb
-    *output = *output << 8; // left shift MSb
-    *output |= low;         // OR with LSb
+    // Serial.read() with a timeout, -1 if nothing arrived
+    unsigned long start = millis();
+    while (!Serial.available())
+    {
+        if (millis() - start > TRANSFER_TIMEOUT)
+        {
+            return -1;
+        }
+    }
+    return Serial.read();
 }
 
-byte process_block(uint16_t *address_register, uint8_t *data_register)
+bool receive_block()
+{
+    for (int block_index = 0; block_index < BLOCK_SIZE; block_index++)
+    {
+        transfer_state = 3;
+        int value = read_transfer_byte();
+        if (value < 0)
+        {
+            return false;
+        }
+        block_buffer[block_index] = value;
+        transfer_state = 4;
+    }
+    return true;
+}
+
+byte process_block(uint32_t *address_register, uint8_t *data_register)
 {
     byte result = 0;
     // First check the checksum of the block
@@ -39,10 +67,14 @@ byte process_block(uint16_t *address_register, uint8_t *data_register)
     }
     if (result == 0)
     {
-        // Get the address (first two bytes)
-        combine_bytes(address_register, block_buffer[0], block_buffer[1]);
+        // Get the address (first ADDRESS_BYTES bytes)
+        combine_bytes(address_register, block_buffer);
         // Get the data byte
-        *data_register = block_buffer[2];
+        *data_register = block_buffer[ADDRESS_BYTES];
+        if (*address_register >= MEMORY_SIZE)
+        {
+            result = 1;
+        }
     }
     return result;
 }
@@ -50,40 +82,37 @@ byte process_block(uint16_t *address_register, uint8_t *data_register)
 void single_block_transfer()
 {
     transfer_state = 1;
-    for (int block_index = 0; block_index < BLOCK_SIZE; block_index++)
+    if (!receive_block())
     {
-        transfer_state = 3;
-        block_buffer[block_index] = Serial.read();
-        transfer_state = 4;
+        transfer_state = 10;
+        return;
     }
 
+    transfer_state = 5;
     byte process_status = process_block(&address_registerA, &data_registerA);
     transfer_state = process_status != 0 ? 10 : 0;
 }
 
-int bulk_transfer(uint16_t *address_array[], uint8_t *data_array[])
+uint8_t bulk_transfer(uint32_t address_array[], uint8_t data_array[], uint8_t count)
 {
-    // Read BULK_BYTE_SIZE bytes into buffer
-    for (int byte_index = 0; byte_index < BULK_BYTE_SIZE; byte_index++)
-    {
-        bulk_transfer_buffer[byte_index] = Serial.read();
-    }
-    // Process each block and load values into provided arrays
-    int block_start_index = 0;
-    for (int block_index = 0; block_index < BULK_BLOCK_COUNT; block_index++)
+    // Receives count back-to-back blocks into the provided arrays
+    // Every block is received even after a bad one so the host's batch is never left half read
+    uint8_t status = 0;
+    for (uint8_t block_index = 0; block_index < count; block_index++)
     {
-        block_start_index = block_index * 4;
-        for (int block_byte_index = 0; block_byte_index < BLOCK_SIZE; block_byte_index++)
+        transfer_state = 2;
+        if (!receive_block())
         {
-            checksum_register += bulk_transfer_buffer[block_start_index + block_byte_index];
+            transfer_state = 10;
+            return TRANSFER_TIMEOUT_STATUS;
         }
-        if (checksum_register != 0)
+        transfer_state = 5;
+        if (process_block(&address_array[block_index], &data_array[block_index]) != 0 && status == 0)
         {
-            return checksum_register;
+            status = block_index + 1;
         }
-        combine_bytes(address_array[block_index], bulk_transfer_buffer[block_start_index], bulk_transfer_buffer[block_start_index + 1]);
-        *data_array[block_index] = bulk_transfer_buffer[block_start_index + 2];
     }
-    return 0;
+    transfer_state = status != 0 ? 10 : 0;
+    return status;
 }
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,144 @@
+// Verify statistics shared by the verify loops (see verify.h)
+// A verify used to print one line per mismatch and always run to the end of the range, with a stuck data line
+// that is tens of thousands of lines over the serial link. The histogram gives the same information in one line:
+//   DG <verdict> fails=<failures>/<compared> stuck_low=0x.. stuck_high=0x.. bits=<d0 failures>,...,<d7 failures>
+// verdict is pass, fail, stuck (stuck_low/stuck_high have bits set), dead or aborted ('q' from the host)
+#include <Arduino.h>
+
+#include <config.h>
+#include <verify.h>
+
+void print_hex(uint32_t number);
+
+// Bits that were expected at a level at least min_samples times and were wrong every time
+byte stuck_bits(const uint32_t *expected, const uint32_t *failures, uint32_t min_samples)
+{
+  byte stuck = 0;
+  for (uint8_t bit = 0; bit < WORD_SIZE; bit++)
+  {
+    if (expected[bit] >= min_samples && failures[bit] == expected[bit])
+    {
+      stuck |= 1 << bit;
+    }
+  }
+  return stuck;
+}
+
+void print_block_failures(verify_stats *stats)
+{
+  if (stats->block_failures == 0)
+  {
+    return;
+  }
+  Serial.print("(");
+  Serial.print(stats->tag);
+  Serial.print(") block ");
+  print_hex(stats->address - stats->address % VERIFY_BLOCK_SIZE);
+  Serial.print(": ");
+  Serial.print(stats->block_failures, DEC);
+  Serial.println(" fails");
+  stats->block_failures = 0;
+}
+
+void verify_begin(verify_stats *stats, const char *tag)
+{
+  memset(stats, 0, sizeof(verify_stats));
+  stats->tag = tag;
+  stats->verdict = VERIFY_OK;
+}
+
+bool verify_byte(verify_stats *stats, uint32_t address, byte expected, byte actual)
+{
+  byte errors = expected ^ actual;
+  stats->address = address;
+  stats->compared++;
+  for (uint8_t bit = 0; bit < WORD_SIZE; bit++)
+  {
+    if ((expected >> bit) & 1)
+    {
+      stats->expected_high[bit]++;
+      stats->low_failures[bit] += (errors >> bit) & 1;
+    }
+    else
+    {
+      stats->expected_low[bit]++;
+      stats->high_failures[bit] += (errors >> bit) & 1;
+    }
+  }
+
+  if (errors)
+  {
+    stats->failures++;
+    stats->block_failures++;
+    stats->verdict = VERIFY_FAILED;
+    if (stats->failures <= VERIFY_REPORT_LIMIT)
+    {
+      Serial.print("(");
+      Serial.print(stats->tag);
+      Serial.print(") addr: ");
+      print_hex(address);
+      Serial.print(" expected ");
+      print_hex(expected);
+      Serial.print(" got ");
+      print_hex(actual);
+      Serial.println();
+    }
+    if (stuck_bits(stats->expected_high, stats->low_failures, VERIFY_MIN_SAMPLES) ||
+        stuck_bits(stats->expected_low, stats->high_failures, VERIFY_MIN_SAMPLES))
+    {
+      // Once one line is clearly stuck, look at the rest with a lower bar: all of them stuck (eg a floating
+      // bus reading 0xFF) is a dead part rather than a bad line
+      byte suspect = stuck_bits(stats->expected_high, stats->low_failures, VERIFY_SUSPECT_SAMPLES) |
+                     stuck_bits(stats->expected_low, stats->high_failures, VERIFY_SUSPECT_SAMPLES);
+      stats->verdict = suspect == (byte)((1 << WORD_SIZE) - 1) ? VERIFY_DEAD : VERIFY_STUCK;
+    }
+    else if (stats->failures == stats->compared && stats->compared >= VERIFY_DEAD_SAMPLES)
+    {
+      // Nothing read back right at all
+      stats->verdict = VERIFY_DEAD;
+    }
+  }
+
+  if (address % VERIFY_BLOCK_SIZE == VERIFY_BLOCK_SIZE - 1)
+  {
+    print_block_failures(stats);
+  }
+  if (Serial.available() && Serial.read() == 'q')
+  {
+    stats->verdict = VERIFY_ABORTED;
+  }
+  if (stats->verdict > VERIFY_FAILED)
+  {
+    print_block_failures(stats);
+    return false;
+  }
+  return true;
+}
+
+void verify_end(verify_stats *stats)
+{
+  static const char *verdicts[] = {"pass", "fail", "stuck", "dead", "aborted"};
+  // The last (partial) block, block_failures is already 0 if it was printed
+  print_block_failures(stats);
+  Serial.print(DIAGNOSIS_MESSAGE);
+  Serial.print(" ");
+  Serial.print(verdicts[stats->verdict]);
+  Serial.print(" fails=");
+  Serial.print(stats->failures, DEC);
+  Serial.print("/");
+  Serial.print(stats->compared, DEC);
+  Serial.print(" stuck_low=");
+  print_hex(stuck_bits(stats->expected_high, stats->low_failures, VERIFY_SUSPECT_SAMPLES));
+  Serial.print(" stuck_high=");
+  print_hex(stuck_bits(stats->expected_low, stats->high_failures, VERIFY_SUSPECT_SAMPLES));
+  Serial.print(" bits=");
+  for (uint8_t bit = 0; bit < WORD_SIZE; bit++)
+  {
+    if (bit != 0)
+    {
+      Serial.print(",");
+    }
+    Serial.print(stats->low_failures[bit] + stats->high_failures[bit], DEC);
+  }
+  Serial.println();
+}
@@ -0,0 +1,276 @@
+# Host protocol throughput benchmark
+# Runs kamf.py and spflash.py against the pseudo-terminal device emulator (emulator.py) and measures
+# bytes per second and latency for dump, program and verify. No hardware needed.
+# spflash-b is spflash.py's per-byte addressing sent as batched scatter/gather transfers (see transfer.py).
+# Results can be saved as JSON and compared against a previous run to catch protocol regressions, eg:
+# python3 bench.py --baud 115200 --json before.json
+# (make changes)
+# python3 bench.py --baud 115200 --compare before.json
+
+import argparse
+import json
+import os
+import random
+import subprocess
+import time
+
+import serial
+
+import emulator
+import kamf
+import spflash
+import transfer
+
+
+def percentile(samples, fraction):
+    ordered = sorted(samples)
+    return ordered[min(len(ordered) - 1, int(fraction * len(ordered)))]
+
+
+class BenchResult:
+    def __init__(self, tool, operation, size):
+        self.tool = tool
+        self.operation = operation
+        self.size = size  # bytes per run
+        self.durations = []  # seconds per run
+        self.latencies = []  # seconds per command round trip (spflash), per block or chunk (kamf) or per run (spflash-b)
+        self.errors = 0  # mismatched bytes seen while verifying
+
+    def as_dict(self):
+        median = percentile(self.durations, 0.5)
+        return {
+            'tool': self.tool,
+            'operation': self.operation,
+            'bytes': self.size,
+            'runs': len(self.durations),
+            'seconds': median,
+            'bytes_per_second': self.size / median if median else 0,
+            'latency_p50': percentile(self.latencies, 0.5),
+            'latency_p99': percentile(self.latencies, 0.99),
+            'latency_max': max(self.latencies),
+            'errors': self.errors,
+        }
+
+
+def count_errors(expected, actual):
+    return sum(1 for a, b in zip(expected, actual) if a != b) + abs(len(expected) - len(actual))
+
+
+class LatencyProbe:
+    # Wraps a serial connection, timing each read that returns data from the previous write or timed read
+    # With marker set only reads returning exactly marker are timed (eg the '.' that acknowledges a pb block)
+    def __init__(self, connection):
+        self.connection = connection
+        self.samples = None  # list the timings are appended to, None to stop timing
+        self.marker = None
+        self.last = 0.0
+
+    def start(self, samples, marker=None):
+        self.samples = samples
+        self.marker = marker
+
+    def write(self, data):
+        self.last = time.perf_counter()
+        return self.connection.write(data)
+
+    def read(self, size=1):
+        data = self.connection.read(size)
+        if data and self.samples is not None and (self.marker is None or data == self.marker):
+            now = time.perf_counter()
+            self.samples.append(now - self.last)
+            self.last = now
+        return data
+
+    def __getattr__(self, name):
+        return getattr(self.connection, name)
+
+
+def bench_kamf(device, chip, image, repeat):
+    size = len(image)
+    dump = BenchResult('kamf', 'dump', size)
+    program = BenchResult('kamf', 'program', size)
+    verify = BenchResult('kamf', 'verify', size)
+    probe = LatencyProbe(device.connection)
+    device.connection = probe
+    for _ in range(repeat):
+        chip.memory[:size] = bytes([0xFF]) * size
+        probe.start(program.latencies, b'.')
+        begin = time.perf_counter()
+        read_back = device.program(0, image)
+        program.durations.append(time.perf_counter() - begin)
+        program.errors += count_errors(image, read_back)
+
+        probe.start(dump.latencies)
+        begin = time.perf_counter()
+        device.dump(0, size)
+        dump.durations.append(time.perf_counter() - begin)
+
+        probe.start(verify.latencies)
+        begin = time.perf_counter()
+        verify.errors += count_errors(image, device.dump(0, size, expected=image))
+        verify.durations.append(time.perf_counter() - begin)
+
+    probe.start(None)
+    device.connection = probe.connection
+    return [dump, program, verify]
+
+
+def bench_spflash(chip, image, repeat):
+    # spflash.py keeps its connection in module globals and has no bulk commands, every byte is a round trip
+    size = len(image)
+    dump = BenchResult('spflash', 'dump', size)
+    program = BenchResult('spflash', 'program', size)
+    verify = BenchResult('spflash', 'verify', size)
+    for _ in range(repeat):
+        chip.memory[:size] = bytes([0xFF]) * size
+        for result, operation in ((program, 'program'), (dump, 'dump'), (verify, 'verify')):
+            begin = time.perf_counter()
+            for address in range(size):
+                start = time.perf_counter()
+                if operation == 'program':
+                    spflash.write_byte(address, image[address])
+                elif spflash.read_byte(address) != image[address] and operation == 'verify':
+                    result.errors += 1
+                result.latencies.append(time.perf_counter() - start)
+            result.durations.append(time.perf_counter() - begin)
+    return [dump, program, verify]
+
+
+def bench_spflash_batched(chip, image, repeat):
+    # The same per-byte addressing as bench_spflash() but sent as scatter program / gather read batches
+    size = len(image)
+    pairs = list(enumerate(image))
+    address_bytes = transfer.address_bytes_for(len(chip.memory))
+    dump = BenchResult('spflash-b', 'dump', size)
+    program = BenchResult('spflash-b', 'program', size)
+    verify = BenchResult('spflash-b', 'verify', size)
+    for _ in range(repeat):
+        chip.memory[:size] = bytes([0xFF]) * size
+        begin = time.perf_counter()
+        program.errors += count_errors(image, transfer.scatter_program(spflash.serial_connection, pairs, address_bytes))
+        program.durations.append(time.perf_counter() - begin)
+
+        begin = time.perf_counter()
+        transfer.gather_read(spflash.serial_connection, range(size), address_bytes)
+        dump.durations.append(time.perf_counter() - begin)
+
+        begin = time.perf_counter()
+        verify.errors += count_errors(image, transfer.gather_read(spflash.serial_connection, range(size), address_bytes))
+        verify.durations.append(time.perf_counter() - begin)
+
+    for result in (dump, program, verify):
+        result.latencies = result.durations
+    return [dump, program, verify]
+
+
+def open_kamf(chip, baud):
+    device = kamf.KAMFDevice(chip.port, baud, quiet=True)
+    device.open()
+    chip.reset()
+    if not device.handshake(timeout=5):
+        raise RuntimeError("No handshake from emulator")
+    return device
+
+
+def open_spflash(chip, baud):
+    spflash.VERBOSE_READ = False
+    spflash.VERBOSE_WRITE = False
+    spflash.serial_device_id = 'emulator'
+    spflash.sram_size = len(chip.memory)
+    spflash.serial_connection = serial.Serial(chip.port, baud, timeout=1)
+    chip.reset()
+    serial_read_line = ""
+    while "rtr" not in serial_read_line:
+        serial_read_line = spflash.serial_connection.readline().decode('utf-8')
+
+
+def git_revision():
+    try:
+        return subprocess.check_output(['git', 'rev-parse', '--short', 'HEAD'],
+                                       cwd=os.path.dirname(os.path.abspath(__file__)),
+                                       stderr=subprocess.DEVNULL).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return 'unknown'
+
+
+def print_results(results, baseline=None):
+    previous = {}
+    if baseline is not None:
+        for result in baseline['results']:
+            previous[(result['tool'], result['operation'])] = result
+
+    print("{:<10} {:<8} {:>8} {:>12} {:>10} {:>10} {:>10} {:>7}".format(
+        'Tool', 'Op', 'Bytes', 'Bytes/s', 'p50 (ms)', 'p99 (ms)', 'max (ms)', 'Errors'), end='')
+    print("  vs baseline" if baseline is not None else '')
+    for result in results:
+        print("{:<10} {:<8} {:>8} {:>12.1f} {:>10.3f} {:>10.3f} {:>10.3f} {:>7}".format(
+            result['tool'], result['operation'], result['bytes'], result['bytes_per_second'],
+            result['latency_p50'] * 1000, result['latency_p99'] * 1000, result['latency_max'] * 1000,
+            result['errors']), end='')
+        old = previous.get((result['tool'], result['operation']))
+        if old is not None and old['bytes_per_second']:
+            change = 100.0 * (result['bytes_per_second'] / old['bytes_per_second'] - 1)
+            kamf.print_color("  {:+.1f}%".format(change), 'g' if change >= -5 else 'r')
+        else:
+            print()
+
+
+def main():
+    parser = argparse.ArgumentParser(description='KAMF host protocol benchmark (uses the pty emulator)')
+    parser.add_argument('--baud', help='Emulated link baud rate, 0 for unthrottled', default=115200, type=int)
+    parser.add_argument('--latency', help='Emulated per-command latency in seconds', default=0.0, type=float)
+    parser.add_argument('--error-rate', help='Probability of a bit flip per byte read', default=0.0, type=float)
+    parser.add_argument('--seed', help='Seed for the image and error injection', default=0, type=int)
+    parser.add_argument('--size', help='Bytes per kamf.py transfer', default=4096, type=lambda x: int(x, 0))
+    parser.add_argument('--spflash-size', help='Bytes per spflash.py transfer (one command per byte)',
+                        default=256, type=lambda x: int(x, 0))
+    parser.add_argument('--repeat', help='Runs of each operation', default=3, type=int)
+    parser.add_argument('--skip-spflash', help='Only benchmark kamf.py', action='store_true')
+    parser.add_argument('--json', help='Save the results to this file', default=None)
+    parser.add_argument('--compare', help='Compare against results saved with --json', default=None)
+    args = parser.parse_args()
+
+    link_baud = args.baud if args.baud else None
+    host_baud = args.baud if args.baud else 115200
+    generator = random.Random(args.seed)
+    image = bytes(generator.randrange(256) for _ in range(max(args.size, args.spflash_size)))
+    results = []
+
+    chip = emulator.Emulator(max(emulator.MEMORY_SIZE, args.size), baud=link_baud, latency=args.latency,
+                             error_rate=args.error_rate, seed=args.seed)
+    chip.start()
+    device = open_kamf(chip, host_baud)
+    results += bench_kamf(device, chip, image[:args.size], args.repeat)
+    device.close()
+    chip.stop()
+
+    if not args.skip_spflash:
+        chip = emulator.Emulator(baud=link_baud, latency=args.latency, error_rate=args.error_rate,
+                                 seed=args.seed, dialect='spflash')
+        chip.start()
+        open_spflash(chip, host_baud)
+        results += bench_spflash(chip, image[:args.spflash_size], args.repeat)
+        results += bench_spflash_batched(chip, image[:args.spflash_size], args.repeat)
+        spflash.serial_connection.close()
+        chip.stop()
+
+    report = {
+        'revision': git_revision(),
+        'parameters': vars(args),
+        'results': [result.as_dict() for result in results],
+    }
+    baseline = None
+    if args.compare is not None:
+        with open(args.compare) as f:
+            baseline = json.load(f)
+        print("Comparing against revision {}".format(baseline['revision']))
+    print_results(report['results'], baseline)
+
+    if args.json is not None:
+        with open(args.json, 'w') as f:
+            json.dump(report, f, indent=2)
+        print("Saved results to {}".format(args.json))
+
+
+if __name__ == "__main__":
+    main()
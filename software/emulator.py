@@ -0,0 +1,327 @@
+# A protocol-accurate stand-in for the KAMF firmware, served on a pseudo-terminal
+# Lets the host tools (kamf.py, spflash.py, gang.py) and bench.py run without any hardware.
+# The emulated memory behaves like an EPROM: erase sets every byte to 0xFF and programming can only clear bits.
+# dialect='spflash' emulates the older firmware spflash.py talks to (lowercase ready message, br/er/bp/ep
+# cycle commands and "address: data" read responses).
+# Optional link modelling: baud rate (throughput of the UART in both directions), per-command latency
+# and error injection (random bit flips in data read back from the "chip").
+# Eg (prints the pty path to pass to kamf.py -p):
+# python3 emulator.py --baud 115200 --latency 0.001
+
+import argparse
+import os
+import random
+import select
+import threading
+import time
+import tty
+
+# Must match firmware/include/constants.h and firmware/include/config.h
+VERSION_STRING = "KAMF v2.0.0"
+DEVICE_READY_MESSAGE = "RTR"
+ACK_MESSAGE = "ACK"
+NACK_MESSAGE = "NCK"
+SEND_DATA_MESSAGE = "SD"
+READ_DATA_MESSAGE = "RD"
+END_DATA_MESSAGE = "ED"
+ABORT_ACK_MESSAGE = "ABT"
+MEMORY_SIZE = 65536
+MEMORY_TESTS = ("March C-", "Checkerboard", "Walking ones", "Address in address")  # firmware/src/memtest.cpp
+PROGRAM_BLOCK_SIZE = 64
+BULK_BLOCK_COUNT = 16  # firmware/include/transfer.h
+BANNER_INTERVAL = 0.5  # seconds
+
+
+class EmulatorStopped(Exception):
+    pass
+
+
+class Emulator:
+    def __init__(self, memory_size=MEMORY_SIZE, baud=None, latency=0.0, error_rate=0.0, seed=None, dialect='kamf',
+                 stuck_low=0, stuck_high=0):
+        self.memory = bytearray([0xFF]) * memory_size
+        self.dialect = dialect
+        self.baud = baud  # None for an unthrottled link
+        self.latency = latency  # seconds added before every command response
+        self.error_rate = error_rate  # probability of a bit flip in each byte read from the chip
+        self.stuck_low = stuck_low  # data lines that always read 0
+        self.stuck_high = stuck_high  # data lines that always read 1
+        self.random = random.Random(seed)
+        self.master, self.slave = os.openpty()
+        # Raw mode on our end too, otherwise the line discipline eats the banner before the host opens the port
+        tty.setraw(self.slave)
+        self.port = os.ttyname(self.slave)
+        self.input_buffer = bytearray()
+        self.link_free_at = 0.0
+        # A pty has no DTR line to reset us when the host opens the port (and pyserial flushes its input on open)
+        # so the banner is repeated until the host starts talking, see reset()
+        self.announcing = True
+        self.last_banner = 0.0
+        self.running = False
+        self.thread = None
+
+    # Link modelling
+
+    def throttle(self, count):
+        if not self.baud:
+            return
+        # 10 bits per byte on the wire (start + 8 data + stop)
+        now = time.monotonic()
+        self.link_free_at = max(self.link_free_at, now) + count * 10.0 / self.baud
+        if self.link_free_at > now:
+            time.sleep(self.link_free_at - now)
+
+    def send(self, data):
+        view = memoryview(data)
+        while view:
+            chunk = view[:PROGRAM_BLOCK_SIZE]
+            self.throttle(len(chunk))
+            written = os.write(self.master, chunk)
+            view = view[written:]
+
+    def println(self, text=''):
+        self.send((text + '\r\n').encode('utf-8'))
+
+    def fill(self, timeout=None):
+        while self.running:
+            ready, _, _ = select.select([self.master], [], [], 0.05 if timeout is None else timeout)
+            if ready:
+                data = os.read(self.master, 4096)
+                self.throttle(len(data))
+                self.input_buffer += data
+                self.announcing = False
+                return True
+            if timeout is not None:
+                return False
+            if self.announcing and time.monotonic() - self.last_banner > BANNER_INTERVAL:
+                self.banner()
+        raise EmulatorStopped()
+
+    def read_byte(self):
+        while not self.input_buffer:
+            self.fill()
+        value = self.input_buffer[0]
+        del self.input_buffer[0]
+        return value
+
+    def available(self):
+        if not self.input_buffer:
+            self.fill(timeout=0)
+        return len(self.input_buffer) > 0
+
+    def read_line(self):
+        # Commands are terminated by '\r', as in firmware loop()
+        while b'\r' not in self.input_buffer:
+            self.fill()
+        index = self.input_buffer.index(b'\r')
+        line = bytes(self.input_buffer[:index])
+        del self.input_buffer[:index + 1]
+        return line.decode('utf-8', errors='replace')
+
+    # Chip model
+
+    def read_chip(self, address):
+        value = self.memory[address]
+        if self.error_rate and self.random.random() < self.error_rate:
+            value ^= 1 << self.random.randrange(8)
+        return (value & ~self.stuck_low) | self.stuck_high
+
+    def program_chip(self, address, value):
+        self.memory[address] &= value
+
+    # Commands, see cmd_* in firmware/src/main.cpp
+
+    def cmd_set_mode(self, mode):
+        return ACK_MESSAGE if mode <= 3 else NACK_MESSAGE
+
+    def cmd_read(self, address):
+        # Like the firmware there is no range check, the address bits above the part's size are simply not wired
+        data = self.read_chip(address % len(self.memory))
+        if self.dialect == 'spflash':
+            return '{:x}: {:x}'.format(address, data)
+        return '{:x}'.format(data)
+
+    def cmd_cycle(self):
+        return ACK_MESSAGE
+
+    def cmd_program_byte(self, address, data):
+        self.program_chip(address % len(self.memory), data & 0xFF)
+        return '{:x}: {:x}'.format(address, data & 0xFF)
+
+    def cmd_erase(self):
+        self.println("Set VPP to 14v then enter 'y' to continue or 'n' to cancel")
+        if self.read_byte() != ord('y'):
+            return NACK_MESSAGE
+        self.println("Erase attempt 1")
+        self.memory[:] = bytes([0xFF]) * len(self.memory)
+        self.println("Verifying erase")
+        for address in range(0, len(self.memory), 0x1000):
+            self.println("(EV): 0x{:X}".format(address))
+        self.println("Erase verified")
+        return ACK_MESSAGE
+
+    def cmd_dump_contents(self, start_address, end_address):
+        if start_address > end_address or end_address > len(self.memory):
+            return NACK_MESSAGE
+        self.println(READ_DATA_MESSAGE)
+        for block_start in range(start_address, end_address, 128):
+            block_end = min(block_start + 128, end_address)
+            self.send(bytes(self.read_chip(address) for address in range(block_start, block_end)))
+            if self.available() and self.read_byte() == ord('q'):
+                self.println()
+                self.println(ABORT_ACK_MESSAGE)
+                return DEVICE_READY_MESSAGE
+        for _ in range(4):
+            self.println()
+        self.println(END_DATA_MESSAGE)
+        return DEVICE_READY_MESSAGE
+
+    def cmd_program_block(self, start_address, end_address):
+        self.println(SEND_DATA_MESSAGE)
+        for address in range(start_address, end_address):
+            self.program_chip(address, self.read_byte())
+            if address == end_address - 1:
+                self.println('.')
+            elif address % PROGRAM_BLOCK_SIZE == PROGRAM_BLOCK_SIZE - 1:
+                self.send(b'.')
+        self.println()
+        self.println(ACK_MESSAGE)
+        self.read_byte()
+        self.println(READ_DATA_MESSAGE)
+        for block_start in range(start_address, end_address, 128):
+            block_end = min(block_start + 128, end_address)
+            self.send(bytes(self.read_chip(address) for address in range(block_start, block_end)))
+            if self.available() and self.read_byte() == ord('q'):
+                self.println()
+                self.println(ABORT_ACK_MESSAGE)
+                return DEVICE_READY_MESSAGE
+        self.println()
+        self.println(END_DATA_MESSAGE)
+        return DEVICE_READY_MESSAGE
+
+    def cmd_scatter_gather(self, count, program):
+        # See scatter_gather() in firmware/src/main.cpp
+        address_bytes = max(2, ((len(self.memory) - 1).bit_length() + 7) // 8)
+        block_size = address_bytes + 2
+        self.println(SEND_DATA_MESSAGE)
+        while count > 0:
+            batch = min(count, BULK_BLOCK_COUNT)
+            blocks = []
+            status = 0
+            for index in range(batch):
+                block = bytes(self.read_byte() for _ in range(block_size))
+                address = int.from_bytes(block[:address_bytes], 'big')
+                if (sum(block) & 0xFF != 0 or address >= len(self.memory)) and status == 0:
+                    status = index + 1
+                blocks.append((address, block[address_bytes]))
+            self.send(bytes([status]))
+            if status != 0:
+                self.input_buffer.clear()
+                self.println()
+                return NACK_MESSAGE
+            if program:
+                for address, data in blocks:
+                    self.program_chip(address, data)
+            reply = bytes(self.read_chip(address) for address, _ in blocks)
+            self.send(reply + bytes([-sum(reply) & 0xFF]))
+            count -= batch
+        self.println()
+        return ACK_MESSAGE
+
+    def cmd_memory_test(self, test, size):
+        # The emulated part is a perfect RAM, every test passes
+        if test > len(MEMORY_TESTS) or size == 0:
+            return NACK_MESSAGE
+        for index, name in enumerate(MEMORY_TESTS):
+            if test == 0 or index == test - 1:
+                self.println("(MT) {}: pass".format(name))
+        return ACK_MESSAGE
+
+    def process_command(self, line):
+        commands = {
+            'm': (1, self.cmd_set_mode),
+            'r': (1, self.cmd_read),
+            'e': (0, self.cmd_erase),
+            'pb': (2, self.cmd_program_block),
+            'p': (2, self.cmd_program_byte),
+            'dc': (2, self.cmd_dump_contents),
+            'mt': (2, self.cmd_memory_test),
+            'sp': (1, lambda count: self.cmd_scatter_gather(count, True)),
+            'gr': (1, lambda count: self.cmd_scatter_gather(count, False)),
+        }
+        if self.dialect == 'spflash':
+            for command in ('br', 'er', 'bp', 'ep'):
+                commands[command] = (0, self.cmd_cycle)
+        parts = line.split()
+        if not parts or parts[0] not in commands:
+            return "parse error"
+        arg_count, handler = commands[parts[0]]
+        try:
+            args = [int(arg, 0) for arg in parts[1:]]
+        except ValueError:
+            return "parse error"
+        if len(args) != arg_count or any(arg < 0 for arg in args):
+            return "parse error"
+        if parts[0] in ('dc', 'pb', 'mt') and args[1] > len(self.memory):
+            return NACK_MESSAGE
+        return handler(*args)
+
+    def banner(self):
+        # What the firmware prints from setup(), ie after a reset
+        self.last_banner = time.monotonic()
+        self.println(VERSION_STRING)
+        self.println(DEVICE_READY_MESSAGE.lower() if self.dialect == 'spflash' else DEVICE_READY_MESSAGE)
+
+    def reset(self):
+        # Equivalent of the DTR reset: announce ourselves again for the next host connection
+        self.announcing = True
+        self.last_banner = 0.0
+
+    def serve(self):
+        try:
+            while self.running:
+                line = self.read_line()
+                if self.latency:
+                    time.sleep(self.latency)
+                self.println(self.process_command(line))
+        except (EmulatorStopped, OSError):
+            pass
+
+    def start(self):
+        self.running = True
+        self.thread = threading.Thread(target=self.serve, daemon=True)
+        self.thread.start()
+        return self.port
+
+    def stop(self):
+        self.running = False
+        if self.thread is not None:
+            self.thread.join()
+        os.close(self.master)
+        os.close(self.slave)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='KAMF device emulator (pseudo-terminal)')
+    parser.add_argument('--size', help='Memory size in bytes', default=MEMORY_SIZE, type=lambda x: int(x, 0))
+    parser.add_argument('--baud', help='Emulated UART baud rate (default: unthrottled)', default=None, type=int)
+    parser.add_argument('--latency', help='Per-command latency in seconds', default=0.0, type=float)
+    parser.add_argument('--error-rate', help='Probability of a bit flip per byte read', default=0.0, type=float)
+    parser.add_argument('--seed', help='Seed for error injection', default=None, type=int)
+    parser.add_argument('--stuck-low', help='Mask of data lines that always read 0', default=0, type=lambda x: int(x, 0))
+    parser.add_argument('--stuck-high', help='Mask of data lines that always read 1', default=0, type=lambda x: int(x, 0))
+    parser.add_argument('--dialect', help='Firmware protocol to emulate', default='kamf', choices=['kamf', 'spflash'])
+    args = parser.parse_args()
+
+    emulator = Emulator(args.size, args.baud, args.latency, args.error_rate, args.seed, args.dialect,
+                        args.stuck_low, args.stuck_high)
+    print("Emulating KAMF on {}".format(emulator.start()))
+    try:
+        while True:
+            time.sleep(1)
+    except KeyboardInterrupt:
+        emulator.stop()
+
+
+if __name__ == "__main__":
+    main()
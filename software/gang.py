@@ -0,0 +1,170 @@
+# Gang programming: drives several KAMF programmers at once from a single host process
+# Each port gets its own KAMFDevice and worker thread, the image is loaded once and shared
+# (read only) between all of the workers. The workers spend nearly all of their time blocked
+# on serial I/O so throughput scales with the number of attached programmers.
+# Used by kamf.py when more than one port is passed to -p, eg:
+# python3 kamf.py -p /dev/ttyUSB0 /dev/ttyUSB1 /dev/ttyUSB2 -e -w -s corn8.bin
+
+import hashlib
+import os
+import threading
+import time
+
+import serial
+
+import kamf
+import transfer
+
+HANDSHAKE_TIMEOUT = 10  # seconds
+PROGRESS_INTERVAL = 0.5  # seconds between redraws of the combined status line
+
+
+class GangResult:
+    def __init__(self, port):
+        self.port = port
+        self.ok = False
+        self.stage = 'open'
+        self.message = ''
+        self.elapsed = 0.0
+        self.sha1 = None
+
+
+class GangProgress:
+    # Collects progress from every worker and renders it as a single status line
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.status = {}
+        self.last_render = 0.0
+
+    def update(self, device, label, done, total):
+        with self.lock:
+            self.status[device.name] = (label.rstrip(':'), done, total)
+            now = time.monotonic()
+            if now - self.last_render < PROGRESS_INTERVAL:
+                return
+            self.last_render = now
+            self.render()
+
+    def set_stage(self, name, stage):
+        with self.lock:
+            self.status[name] = (stage, 0, 0)
+
+    def render(self):
+        parts = []
+        for name, (label, done, total) in sorted(self.status.items()):
+            percent = 100 * done // total if total else 0
+            parts.append('{} {} {}%'.format(name, label, percent))
+        print('\r' + ' | '.join(parts) + '\033[K', end='', flush=True)
+
+
+def per_device_filename(filename, name):
+    # read_data.bin -> read_data.ttyUSB0.bin
+    root, ext = os.path.splitext(filename)
+    return '{}.{}{}'.format(root, name, ext)
+
+
+def worker(port, baud, start_address, end_address, erase, read_filename, source_image, verify_image, verbose, progress,
+           result):
+    begin = time.monotonic()
+    device = kamf.KAMFDevice(port, baud, verbose=verbose, quiet=True,
+                             progress_callback=progress.update)
+    try:
+        device.open()
+        result.stage = 'handshake'
+        progress.set_stage(device.name, result.stage)
+        if not device.handshake(timeout=HANDSHAKE_TIMEOUT):
+            result.message = 'no response from device'
+            return
+
+        if read_filename is not None:
+            result.stage = 'read'
+            data = device.dump(start_address, end_address)
+            with open(per_device_filename(read_filename, device.name), 'wb') as f:
+                f.write(data)
+            result.sha1 = hashlib.sha1(data).hexdigest()
+
+        if erase:
+            result.stage = 'erase'
+            progress.set_stage(device.name, result.stage)
+            if not device.erase():
+                result.message = 'erase failed'
+                return
+
+        if source_image is not None:
+            sha1 = hashlib.sha1()
+            result.stage = 'write'
+            programmed = device.program_image(source_image)
+            result.stage = 'verify'
+            for extent, read_back_bytes, stats in sorted(programmed, key=lambda item: item[0].start):
+                sha1.update(read_back_bytes)
+                if not kamf.compare_read_back(extent.data, read_back_bytes, log=lambda text: None):
+                    result.message = 'read-back mismatch at {}'.format(hex(extent.start))
+                    if stats is not None:
+                        result.message += ': ' + stats.diagnosis()
+                    return
+            result.sha1 = sha1.hexdigest()
+
+        if verify_image is not None:
+            sha1 = hashlib.sha1()
+            result.stage = 'verify'
+            progress.set_stage(device.name, result.stage)
+            for extent in verify_image.extents:
+                read_back_bytes = device.dump(extent.start, extent.end, expected=extent.data)
+                sha1.update(read_back_bytes)
+                if not kamf.compare_read_back(extent.data, read_back_bytes, log=lambda text: None):
+                    result.message = 'mismatch in {}-{}: {}'.format(
+                        hex(extent.start), hex(extent.end), device.last_verify.diagnosis())
+                    return
+            result.sha1 = sha1.hexdigest()
+
+        result.stage = 'done'
+        result.ok = True
+    except (OSError, serial.SerialException, kamf.DeviceTimeout, transfer.TransferError) as e:
+        result.message = str(e)
+    finally:
+        device.close()
+        result.elapsed = time.monotonic() - begin
+        progress.set_stage(device.name, 'pass' if result.ok else 'FAIL')
+
+
+def run(ports, baud, start_address, end_address, erase=False, read_filename=None, source_image=None, verify_image=None,
+        verbose=False):
+    # Runs the requested operations on every port in parallel, returns a list of GangResult
+    # source_image (written) and verify_image (compared against) are images (see image.py) shared by all of the
+    # workers and never copied
+    progress = GangProgress()
+    results = [GangResult(port) for port in ports]
+    threads = []
+    for port, result in zip(ports, results):
+        thread = threading.Thread(target=worker, name=port, daemon=True,
+                                  args=(port, baud, start_address, end_address, erase,
+                                        read_filename, source_image, verify_image, verbose, progress, result))
+        threads.append(thread)
+        thread.start()
+
+    for thread in threads:
+        thread.join()
+
+    with progress.lock:
+        progress.render()
+    print()
+    return results
+
+
+def report(results):
+    # Prints the aggregated pass/fail report, returns True if every device passed
+    passed = 0
+    print("{:<20} {:<6} {:<10} {:>8}  {}".format('Port', 'Result', 'Stage', 'Time', 'Detail'))
+    for result in results:
+        if result.ok:
+            passed += 1
+        detail = result.message if result.message else (result.sha1 or '')
+        line = "{:<20} {:<6} {:<10} {:>7.1f}s  {}".format(
+            result.port, 'PASS' if result.ok else 'FAIL', result.stage, result.elapsed, detail)
+        kamf.print_color(line, 'g' if result.ok else 'r')
+
+    total_time = max([result.elapsed for result in results], default=0)
+    kamf.print_color("{}/{} devices passed in {:.1f}s".format(passed, len(results), total_time),
+                     'g' if passed == len(results) else 'r')
+    return passed == len(results)
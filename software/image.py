@@ -0,0 +1,206 @@
+# Memory image loader shared by kamf.py and spflash.py
+# Parses Intel HEX, Motorola S-records and raw BIN files into a sorted list of extents (contiguous runs of
+# populated bytes). Gaps between extents are never transferred, so a sparse image (eg a reset vector at the
+# top of the ROM and code at the bottom) only costs the bytes it actually contains.
+
+import mmap
+import os
+
+INTEL_HEX_EXTENSIONS = ('.hex', '.ihx', '.ihex')
+SRECORD_EXTENSIONS = ('.s19', '.s28', '.s37', '.srec', '.mot', '.s')
+
+
+class Extent:
+    def __init__(self, start, data):
+        self.start = start
+        self.data = data
+
+    @property
+    def end(self):
+        return self.start + len(self.data)
+
+    def __repr__(self):
+        return 'Extent({}, {})'.format(hex(self.start), len(self.data))
+
+
+class Image:
+    def __init__(self, extents=None):
+        self.extents = extents if extents is not None else []
+
+    def __len__(self):
+        # Number of populated bytes (gaps excluded)
+        return sum(len(extent.data) for extent in self.extents)
+
+    @property
+    def start(self):
+        return self.extents[0].start if self.extents else 0
+
+    @property
+    def end(self):
+        return self.extents[-1].end if self.extents else 0
+
+    def clip(self, start_address, end_address):
+        # Returns a new image containing only [start_address, end_address), slices are views (no copies)
+        extents = []
+        for extent in self.extents:
+            start = max(extent.start, start_address)
+            end = min(extent.end, end_address)
+            if start < end:
+                view = memoryview(extent.data)[start - extent.start:end - extent.start]
+                extents.append(Extent(start, view))
+        return Image(extents)
+
+    def offset(self, delta):
+        # Returns a new image moved by delta bytes (eg from CPU addresses to chip addresses)
+        return Image([Extent(extent.start + delta, extent.data) for extent in self.extents])
+
+    def items(self):
+        # (address, data) for every populated byte, in address order
+        for extent in self.extents:
+            for index, value in enumerate(extent.data):
+                yield extent.start + index, value
+
+
+def build(chunks):
+    # Sorts (address, bytes) chunks and merges touching ones into extents, overlapping data is an error
+    extents = []
+    for start, data in sorted(chunks, key=lambda chunk: chunk[0]):
+        if not data:
+            continue
+        if extents and start < extents[-1].end:
+            raise ValueError("Overlapping data at address {}".format(hex(start)))
+        if extents and start == extents[-1].end:
+            extents[-1].data += data
+        else:
+            extents.append(Extent(start, bytearray(data)))
+    return Image(extents)
+
+
+def parse_intel_hex(lines):
+    chunks = []
+    base_address = 0
+    for line_number, line in enumerate(lines, 1):
+        line = line.strip()
+        if line == '':
+            continue
+        if not line.startswith(':'):
+            raise ValueError("Line {}: missing ':' start code".format(line_number))
+        try:
+            record = bytes.fromhex(line[1:])
+        except ValueError:
+            raise ValueError("Line {}: invalid hex digits".format(line_number))
+        if len(record) < 5 or len(record) != record[0] + 5:
+            raise ValueError("Line {}: bad record length".format(line_number))
+        if sum(record) & 0xFF != 0:
+            raise ValueError("Line {}: checksum mismatch".format(line_number))
+
+        record_type, data = record[3], record[4:-1]
+        address = (record[1] << 8) | record[2]
+        if record_type == 0x00:
+            chunks.append((base_address + address, data))
+        elif record_type == 0x01:
+            break
+        elif record_type in (0x02, 0x04) and len(data) != 2:
+            raise ValueError("Line {}: address record needs 2 data bytes, got {}".format(line_number, len(data)))
+        elif record_type == 0x02:
+            # Extended segment address
+            base_address = ((data[0] << 8) | data[1]) << 4
+        elif record_type == 0x04:
+            # Extended linear address
+            base_address = ((data[0] << 8) | data[1]) << 16
+        elif record_type in (0x03, 0x05):
+            # Start address records, nothing to program
+            pass
+        else:
+            raise ValueError("Line {}: unknown record type {:02X}".format(line_number, record_type))
+    return build(chunks)
+
+
+def parse_srecord(lines):
+    # Address field width for each data record type
+    address_bytes = {'1': 2, '2': 3, '3': 4}
+    chunks = []
+    for line_number, line in enumerate(lines, 1):
+        line = line.strip()
+        if line == '':
+            continue
+        if len(line) < 4 or line[0] != 'S':
+            raise ValueError("Line {}: not an S-record".format(line_number))
+        try:
+            record = bytes.fromhex(line[2:])
+        except ValueError:
+            raise ValueError("Line {}: invalid hex digits".format(line_number))
+        if len(record) != record[0] + 1:
+            raise ValueError("Line {}: bad record length".format(line_number))
+        if sum(record) & 0xFF != 0xFF:
+            raise ValueError("Line {}: checksum mismatch".format(line_number))
+
+        record_type = line[1]
+        if record_type in address_bytes:
+            width = address_bytes[record_type]
+            address = int.from_bytes(record[1:1 + width], 'big')
+            chunks.append((address, record[1 + width:-1]))
+        elif record_type in '789':
+            # Termination
+            break
+        elif record_type in '0356':
+            # Header and record count, nothing to program
+            pass
+        else:
+            raise ValueError("Line {}: unknown record type S{}".format(line_number, record_type))
+    return build(chunks)
+
+
+def load(filename, base_address=0, file_format=None):
+    # file_format is 'hex', 'srec' or 'bin', by default it is picked from the file extension
+    # base_address only applies to BIN files, the other formats carry their own addresses
+    if file_format is None:
+        extension = os.path.splitext(filename)[1].lower()
+        if extension in INTEL_HEX_EXTENSIONS:
+            file_format = 'hex'
+        elif extension in SRECORD_EXTENSIONS:
+            file_format = 'srec'
+        else:
+            file_format = 'bin'
+
+    if file_format == 'bin':
+        with open(filename, 'rb') as f:
+            try:
+                # Mapped rather than read, the image is never copied on its way to the serial port
+                data = memoryview(mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ))
+            except ValueError:
+                # Empty files can't be mapped
+                return Image()
+        return Image([Extent(base_address, data)])
+
+    try:
+        with open(filename, 'r') as f:
+            lines = f.readlines()
+    except UnicodeDecodeError:
+        raise ValueError("Not a text file, raw binary images need a .bin (or other non-HEX/S-record) extension")
+    if file_format == 'hex':
+        return parse_intel_hex(lines)
+    if file_format == 'srec':
+        return parse_srecord(lines)
+    raise ValueError("Unknown image format: {}".format(file_format))
+
+
+def write_intel_hex(image, f, record_size=16):
+    base_address = None
+    for extent in image.extents:
+        offset = 0
+        while offset < len(extent.data):
+            address = extent.start + offset
+            # Records may not cross a 64k boundary
+            length = min(record_size, len(extent.data) - offset, 0x10000 - (address & 0xFFFF))
+            if address >> 16 != base_address:
+                base_address = address >> 16
+                write_intel_hex_record(f, 0, 0x04, base_address.to_bytes(2, 'big'))
+            write_intel_hex_record(f, address & 0xFFFF, 0x00, bytes(extent.data[offset:offset + length]))
+            offset += length
+    write_intel_hex_record(f, 0, 0x01, b'')
+
+
+def write_intel_hex_record(f, address, record_type, data):
+    record = bytes([len(data), address >> 8, address & 0xFF, record_type]) + data
+    f.write(':{}{:02X}\n'.format(record.hex().upper(), (-sum(record)) & 0xFF))
@@ -6,12 +6,16 @@ import argparse
 import signal
 import time
 
+import image
+import transfer
+
 # connects to device over serial port and provides a more human readable interface
 # Makes use of the erase ('e'), read ('r') and program block ('pb') commands provided by the device
 # but wraps them in a more user friendly interface rather than requiring the user to send raw bytes over minicom
 
 serial_port = '/dev/ttyUSB0'
 baud_rate = 115200
+memory_size = 0x10000  # bytes, must match MEMORY_SIZE in firmware/include/config.h (eg 0x80000 for a 27C040)
 DEVICE_READY_MESSAGE = "RTR"
 
 ACK_MESSAGE = "ACK"
@@ -22,9 +26,19 @@ ABORT_ACK_MESSAGE = "ABT"
 DATA_END_MESSAGE = "ED"
 VERBOSE = False
 DISABLE_PROGRESS_BAR = False
+PROGRAM_BLOCK_SIZE = 64  # Bytes the device buffers per 'pb' block (PROGRAM_BLOCK_SIZE in firmware/include/config.h)
+SCATTER_EXTENT_SIZE = 16  # Extents shorter than this are patched together with one scatter program ('sp') instead of a 'pb' each
+PROGRESS_INTERVAL = 0.1  # Minimum seconds between progress bar redraws
+RESPONSE_TIMEOUT = 10  # Seconds the device may stay silent mid-operation before it is given up on
+MEMORY_TEST_TIMEOUT = 600  # The RAM test only reports at the end of each test, these run for minutes on the larger parts
+# Read-back checking, same thresholds as firmware/include/verify.h
+VERIFY_MIN_SAMPLES = 32  # A bit is stuck once it has been expected at a level this many times and never read back at it
+VERIFY_SUSPECT_SAMPLES = 8  # Lower bar for the bits listed in the diagnosis (and for telling a dead part from one stuck line)
+VERIFY_DEAD_SAMPLES = 256  # The part is dead if every one of this many bytes failed
+VERIFY_REPORT_LIMIT = 16  # Mismatches listed in the diagnosis
+VERIFY_BLOCK_SIZE = 0x1000  # Failures are also counted per block of this many bytes
 
 
-serial_connection = None
 read_speed = 255  # bytes per second
 rainbow = ['\033[91m', '\033[93m', '\033[92m',
            '\033[94m', '\033[95m', '\033[96m', '\033[97m']
@@ -77,9 +91,388 @@ def printProgressBar(iteration, total, prefix='', suffix='', decimals=1, length=
         print()
 
 
+class VerifyStats:
+    # Compares read-back data as it arrives and decides when a verify can stop early
+    # Keeps a per data bit error histogram, a stuck data line or dead part is diagnosed from the first few
+    # hundred bytes instead of after the whole transfer (see firmware/src/verify.cpp for the device side)
+
+    def __init__(self, start_address, word_size=8):
+        self.start_address = start_address
+        self.word_size = word_size
+        self.compared = 0
+        self.failures = 0
+        self.mismatches = []  # (address, expected, actual), the first VERIFY_REPORT_LIMIT only
+        self.expected_high = [0] * word_size
+        self.expected_low = [0] * word_size
+        self.low_failures = [0] * word_size  # Expected 1, read 0
+        self.high_failures = [0] * word_size  # Expected 0, read 1
+        self.seen_high = 0  # Bits read back correctly as 1 at least once, these can't be stuck low
+        self.seen_low = 0
+        self.block_failures = {}  # Block start address -> failures, blocks without failures are left out
+        self.verdict = 'pass'
+
+    def healthy(self):
+        # Once every bit has been read back right at both levels no stuck verdict is possible
+        full = (1 << self.word_size) - 1
+        return self.seen_high == full and self.seen_low == full
+
+    def stuck_bits(self, expected, failures, min_samples):
+        stuck = 0
+        for bit in range(self.word_size):
+            if expected[bit] >= min_samples and failures[bit] == expected[bit]:
+                stuck |= 1 << bit
+        return stuck
+
+    def update(self, offset, expected, actual):
+        # Compares a chunk received at offset (from start_address), returns False once the verify should stop
+        self.compared += len(actual)
+        if expected == actual and self.healthy():
+            return True
+
+        full = (1 << self.word_size) - 1
+        for index, (wanted, got) in enumerate(zip(expected, actual)):
+            errors = wanted ^ got
+            if not self.healthy():
+                self.seen_high |= wanted & got
+                self.seen_low |= ~wanted & ~got & full
+                for bit in range(self.word_size):
+                    if (wanted >> bit) & 1:
+                        self.expected_high[bit] += 1
+                    else:
+                        self.expected_low[bit] += 1
+            if not errors:
+                continue
+            self.failures += 1
+            address = self.start_address + offset + index
+            block = address - address % VERIFY_BLOCK_SIZE
+            self.block_failures[block] = self.block_failures.get(block, 0) + 1
+            if len(self.mismatches) < VERIFY_REPORT_LIMIT:
+                self.mismatches.append((address, wanted, got))
+            for bit in range(self.word_size):
+                if (errors >> bit) & 1:
+                    if (wanted >> bit) & 1:
+                        self.low_failures[bit] += 1
+                    else:
+                        self.high_failures[bit] += 1
+
+        if self.failures:
+            self.verdict = 'fail'
+        if self.stuck_low(VERIFY_MIN_SAMPLES) | self.stuck_high(VERIFY_MIN_SAMPLES):
+            # Every line suspect is a dead part (eg a floating bus) rather than one bad line
+            self.verdict = 'dead' if self.stuck_low() | self.stuck_high() == full else 'stuck'
+        elif self.failures == self.compared and self.compared >= VERIFY_DEAD_SAMPLES:
+            self.verdict = 'dead'
+        return self.verdict in ('pass', 'fail')
+
+    # The expected_* counts stop once healthy() while the failure counts carry on, so the equality test in
+    # stuck_bits() alone could flag a bit that has since been read back right. Those bits are masked out.
+
+    def stuck_low(self, min_samples=VERIFY_SUSPECT_SAMPLES):
+        return self.stuck_bits(self.expected_high, self.low_failures, min_samples) & ~self.seen_high
+
+    def stuck_high(self, min_samples=VERIFY_SUSPECT_SAMPLES):
+        return self.stuck_bits(self.expected_low, self.high_failures, min_samples) & ~self.seen_low
+
+    def diagnosis(self):
+        # Same layout as the firmware's DG line, plus the failures per block (the firmware prints those as it goes)
+        bits = [low + high for low, high in zip(self.low_failures, self.high_failures)]
+        text = "{} fails={}/{} stuck_low={} stuck_high={} bits={}".format(
+            self.verdict, self.failures, self.compared, hex(self.stuck_low()), hex(self.stuck_high()),
+            ','.join(str(count) for count in bits))
+        if self.block_failures:
+            text += " blocks=" + ','.join('{}:{}'.format(hex(block), count)
+                                          for block, count in sorted(self.block_failures.items()))
+        return text
+
+
+class DeviceTimeout(serial.SerialException):
+    # The device stopped answering part way through an operation
+    pass
+
+
+class KAMFDevice:
+    """
+    A single KAMF programmer attached to a serial port.
+    All of the per-connection state lives here (rather than in module globals) so that
+    one host process can drive several programmers at once, see gang.py
+    """
+
+    def __init__(self, port, baud=baud_rate, verbose=False, show_progress=True, quiet=False, progress_callback=None):
+        self.port = port
+        self.baud = baud
+        self.name = port.split('/')[-1]
+        self.verbose = verbose
+        self.show_progress = show_progress
+        self.quiet = quiet  # Suppress all console output (used when several devices share one terminal)
+        # Optional callable(device, label, done, total) used instead of the console progress bar
+        self.progress_callback = progress_callback
+        self.last_progress = 0.0
+        self.connection = None
+        self.last_verify = None  # VerifyStats of the last checked read
+
+    def log(self, text, color=None):
+        if self.quiet:
+            return
+        if color is None:
+            print(text)
+        else:
+            print_color(text, color)
+
+    def progress(self, label, done, total):
+        # Rate limited by time rather than bytes, the first and last updates are always drawn
+        now = time.monotonic()
+        if 0 < done < total and now - self.last_progress < PROGRESS_INTERVAL:
+            return
+        self.last_progress = now
+        if self.progress_callback is not None:
+            self.progress_callback(self, label, done, total)
+        elif self.show_progress and not self.verbose and not self.quiet:
+            printProgressBar(done, total, prefix=label, length=50,
+                             suffix='{}/{}'.format(done, total))
+
+    def open(self):
+        self.connection = serial.Serial(self.port, self.baud,
+                                        bytesize=serial.EIGHTBITS,
+                                        parity=serial.PARITY_NONE,
+                                        stopbits=serial.STOPBITS_ONE,
+                                        timeout=1,
+                                        xonxoff=0,
+                                        rtscts=0
+                                        )
+        # Toggle DTR to reset Arduino
+        try:
+            self.connection.setDTR(False)
+            time.sleep(1)
+            # toss any data already received, see
+            # http://pyserial.sourceforge.net/pyserial_api.html#serial.Serial.flushInput
+            self.connection.flushInput()
+            self.connection.setDTR(True)
+        except (OSError, serial.SerialException):
+            # Pseudo-terminals (eg a device emulator) have no modem control lines
+            pass
+
+    def close(self):
+        if self.connection is not None:
+            self.connection.close()
+            self.connection = None
+
+    def handshake(self, timeout=None):
+        # Waits for the ready message; gives up after timeout seconds (None waits forever)
+        self.log("Opened port, handshaking...")
+        deadline = None if timeout is None else time.monotonic() + timeout
+        response = self.connection.readline()
+        readline = response.decode('utf-8')
+        while DEVICE_READY_MESSAGE not in readline:
+            if deadline is not None and time.monotonic() > deadline:
+                self.log("Handshake timed out", 'r')
+                return False
+            response = self.connection.readline()
+            readline = response.decode('utf-8')
+            if readline != '' and not self.quiet:
+                print(readline, end='')
+
+        self.log("Device connected successfully")
+        return True
+
+    def readline(self, timeout=RESPONSE_TIMEOUT):
+        # Returns the next (non-empty) line from the device, raises DeviceTimeout after timeout seconds of silence
+        deadline = time.monotonic() + timeout
+        while True:
+            response = self.connection.readline()
+            if response != b'':
+                return response.decode('utf-8', errors='replace')
+            if time.monotonic() > deadline:
+                raise DeviceTimeout("{}: no response for {}s".format(self.name, timeout))
+
+    def wait_for_byte(self, marker, timeout=RESPONSE_TIMEOUT):
+        # Discards input up to and including marker, raises DeviceTimeout after timeout seconds of silence
+        deadline = time.monotonic() + timeout
+        while True:
+            response = self.connection.read(1)
+            if response == marker:
+                return
+            if response != b'':
+                deadline = time.monotonic() + timeout
+            elif time.monotonic() > deadline:
+                raise DeviceTimeout("{}: no response for {}s".format(self.name, timeout))
+
+    def read_until(self, message):
+        readline = self.readline()
+        while message not in readline:
+            readline = self.readline()
+            if not self.quiet:
+                print(readline, end='')
+            if NACK_MESSAGE in readline:
+                self.log("Failed, exiting...")
+                return False
+
+        return True
+
+    def clear_serial_buffer(self):
+        self.connection.flushInput()
+        self.connection.flushOutput()
+
+    def erase(self):
+        self.connection.write(b'e\r')
+        readline = self.readline()
+        self.connection.write(b'y')
+        while ACK_MESSAGE not in readline:
+            readline = self.readline().strip()
+            self.log(readline, 'b')
+            if NACK_MESSAGE in readline:
+                self.log("Erase failed, exiting...", 'r')
+                return False
+
+        self.log("Erase successful", 'g')
+        return True
+
+    def read_data(self, count, label, stats=None, expected=None):
+        # Reads count raw bytes into a preallocated buffer, taking whatever has arrived in one call
+        # With stats (a VerifyStats) each chunk is compared against expected as it arrives, the read stops
+        # early (returning what was received) once stats has seen enough to fail the verify
+        # Raises DeviceTimeout if the device sends nothing for RESPONSE_TIMEOUT seconds
+        data = bytearray(count)
+        view = memoryview(data)
+        received = 0
+        deadline = time.monotonic() + RESPONSE_TIMEOUT
+        self.progress(label, 0, count)
+        while received < count:
+            waiting = self.connection.in_waiting
+            chunk = self.connection.read(min(count - received, max(1, waiting)))
+            if chunk == b'':
+                if time.monotonic() > deadline:
+                    raise DeviceTimeout("{}: no data for {}s after {}/{} bytes".format(
+                        self.name, RESPONSE_TIMEOUT, received, count))
+                continue
+            deadline = time.monotonic() + RESPONSE_TIMEOUT
+            view[received:received + len(chunk)] = chunk
+            if stats is not None and not stats.update(received, expected[received:received + len(chunk)], chunk):
+                return data[:received + len(chunk)]
+            received += len(chunk)
+            self.progress(label, received, count)
+        return data
+
+    def finish_read(self, stats):
+        # Ends a read started by dump() or program(), aborting it if stats stopped it early
+        self.last_verify = stats
+        if stats is not None and stats.verdict not in ('pass', 'fail'):
+            self.connection.write(b'q')
+            readline = ''
+            while ABORT_ACK_MESSAGE not in readline and DATA_END_MESSAGE not in readline:
+                readline = self.readline()
+            if DATA_END_MESSAGE in readline:
+                # The device had already sent everything, the 'q' is waiting in its command buffer: turn it
+                # into an (unknown) command so it doesn't prefix the next one
+                self.read_until(DEVICE_READY_MESSAGE)
+                self.connection.write(b'\r')
+                self.connection.readline()
+            self.log("Read-back stopped early: {}".format(stats.diagnosis()), 'r')
+        else:
+            self.read_until(DATA_END_MESSAGE)
+        self.clear_serial_buffer()
+
+    def dump(self, start_address, end_address, expected=None):
+        # Returns the content of [start_address, end_address) as a bytearray
+        # Given the expected content the read is checked as it arrives (see VerifyStats, self.last_verify)
+        self.connection.write('dc {} {}\r'.format(
+            start_address, end_address).encode('utf-8'))
+        self.read_until(RECEIVE_DATA_MESSAGE)
+        stats = VerifyStats(start_address) if expected is not None else None
+        data = self.read_data(end_address - start_address, 'Reading memory:', stats, expected)
+        self.finish_read(stats)
+        return data
+
+    def program(self, start_address, data):
+        # Programs data (any bytes-like object) from start_address, then returns the device's read-back
+        # The read-back is checked as it arrives and cut short if a stuck data line or dead part shows up
+        data = memoryview(data)
+        end_address = start_address + len(data)
+        self.connection.write('pb {} {}\r'.format(
+            start_address, end_address).encode('utf-8'))
+        self.read_until(SEND_DATA_MESSAGE)
+
+        self.progress('Sending bytes:', 0, len(data))
+        offset = 0
+        while offset < len(data):
+            # Send one device buffer worth in a single write, then wait for the . once it has been programmed
+            # The device buffers by absolute address so blocks are aligned to PROGRAM_BLOCK_SIZE
+            block_length = PROGRAM_BLOCK_SIZE - (start_address + offset) % PROGRAM_BLOCK_SIZE
+            block = data[offset:offset + block_length]
+            self.connection.write(block)
+            self.wait_for_byte(b'.')
+
+            offset += len(block)
+            self.progress('Sending bytes:', offset, len(data))
+
+        self.log("Sent bytes, awaiting confirmation...")
+        self.read_until(ACK_MESSAGE)
+
+        self.log("Device acknowledged data, read-back starting...")
+        self.connection.write('\r'.encode('utf-8'))
+        self.read_until(RECEIVE_DATA_MESSAGE)
+        stats = VerifyStats(start_address)
+        read_back_bytes = self.read_data(len(data), 'Read-back:', stats, data)
+        self.finish_read(stats)
+        return read_back_bytes
+
+    def scatter_program(self, pairs):
+        # Programs (address, data) pairs at arbitrary addresses in batches, returns the read-back of each address
+        self.log("Scatter programming {} bytes...".format(len(pairs)))
+        return transfer.scatter_program(self.connection, pairs, transfer.address_bytes_for(memory_size),
+                                        lambda done, total: self.progress('Patching:', done, total))
+
+    def gather_read(self, addresses):
+        # Reads arbitrary addresses in batches, returns their content in the same order
+        return transfer.gather_read(self.connection, addresses, transfer.address_bytes_for(memory_size),
+                                    lambda done, total: self.progress('Reading:', done, total))
+
+    def program_image(self, source_image):
+        # Programs every extent of an image.Image, returns [(extent, read_back_bytes, VerifyStats or None)]
+        # Long extents are sent with 'pb', the short ones are gathered into one scatter program
+        results = []
+        patches = []
+        for extent in source_image.extents:
+            if len(extent.data) < SCATTER_EXTENT_SIZE:
+                patches.append(extent)
+                continue
+            read_back_bytes = self.program(extent.start, extent.data)
+            results.append((extent, read_back_bytes, self.last_verify))
+
+        if patches:
+            pairs = [(address, value) for extent in patches for address, value in image.Image([extent]).items()]
+            read_back_bytes = self.scatter_program(pairs)
+            offset = 0
+            for extent in patches:
+                results.append((extent, read_back_bytes[offset:offset + len(extent.data)], None))
+                offset += len(extent.data)
+        return results
+
+    def test_ram(self, test, size):
+        # Runs the firmware's SRAM march test(s) (test 0 runs all of them) over the first size bytes
+        # Needs the RAM adapter (SRAM /WE wired to the programmer) and firmware built with MEMORY_TEST_CODE,
+        # returns True if every test passed
+        self.connection.write('mt {} {}\r'.format(test, size).encode('utf-8'))
+        while True:
+            readline = self.readline(timeout=MEMORY_TEST_TIMEOUT).strip()
+            if 'error' in readline:
+                # The command parser doesn't know 'mt'
+                self.log("The firmware was built without MEMORY_TEST_CODE (see firmware/include/config.h)", 'r')
+                return False
+            if readline.startswith('(MT)'):
+                self.log(readline, 'g' if readline.endswith('pass') else 'r')
+            elif readline == ACK_MESSAGE:
+                return True
+            elif readline == NACK_MESSAGE:
+                return False
+
+
+# The device used by the interactive menu and the single-port command line options
+device = None
+
+
 def close_connection():
-    if serial_connection is not None:
-        serial_connection.close()
+    if device is not None:
+        device.close()
 
 
 def exit_handler(sig, frame):
@@ -88,39 +481,6 @@ def exit_handler(sig, frame):
     sys.exit(0)
 
 
-def open_port():
-    global serial_connection
-    serial_connection = serial.Serial(serial_port, baud_rate,
-                                      bytesize=serial.EIGHTBITS,
-                                      parity=serial.PARITY_NONE,
-                                      stopbits=serial.STOPBITS_ONE,
-                                      timeout=1,
-                                      xonxoff=0,
-                                      rtscts=0
-                                      )
-    # Toggle DTR to reset Arduino
-    serial_connection.setDTR(False)
-    time.sleep(1)
-    # toss any data already received, see
-    # http://pyserial.sourceforge.net/pyserial_api.html#serial.Serial.flushInput
-    serial_connection.flushInput()
-    serial_connection.setDTR(True)
-
-
-def handshake():
-    print("Opened port, handshaking...")
-    response = serial_connection.readline()
-    readline = response.decode('utf-8')
-    while DEVICE_READY_MESSAGE not in readline:
-        response = serial_connection.readline()
-        readline = response.decode('utf-8')
-        if readline != '':
-            print(readline, end='')
-
-    print("Device connected successfully")
-    return True
-
-
 def top_menu():
     print("Options:")
     print("1. Erase memory (sets entire memory to 0xFF)")
@@ -156,193 +516,141 @@ def raw_terminal():
     print("Raw terminal, press Ctrl+C to exit")
     while True:
         try:
-            readline = serial_connection.readline()
+            readline = device.connection.readline()
             print(readline.decode('utf-8'), end='')
             command = input(": ") + '\r'
-            serial_connection.write(command.encode('utf-8'))
+            device.connection.write(command.encode('utf-8'))
         except KeyboardInterrupt:
             break
 
 
 def erase_device():
-    serial_connection.write(b'e\r')
-    response = serial_connection.readline()
-    readline = response.decode('utf-8')
-    serial_connection.write(b'y')
-    while ACK_MESSAGE not in readline:
-        response = serial_connection.readline()
-        readline = response.decode('utf-8')
-        readline = readline.strip()
-        print_color(readline, 'b')
-        if NACK_MESSAGE in readline:
-            print_color("Erase failed, exiting...", 'r')
-            return False
-
-    print_color("Erase successful", 'g')
-    return True
-
-
-def read_until(message):
-    response = serial_connection.readline()
-    readline = response.decode('utf-8')
-    while message not in readline:
-        response = serial_connection.readline()
-        if response == b'':
-            continue
-
-        readline = response.decode('utf-8')
-        if readline != '':
-            print(readline, end='')
-        if NACK_MESSAGE in readline:
-            print("Failed, exiting...")
-            return False
-
-    return True
-
-
-def clear_serial_buffer():
-    serial_connection.flushInput()
-    serial_connection.flushOutput()
+    return device.erase()
 
 
 def dump_content(start_address, end_address, filename):
-    serial_connection.write('dc {} {}\r'.format(
-        start_address, end_address).encode('utf-8'))
-    read_until(RECEIVE_DATA_MESSAGE)
-    data = bytearray()
-    if not DISABLE_PROGRESS_BAR and not VERBOSE:
-        printProgressBar(0, end_address - start_address,
-                         prefix='Reading memory:', length=50, suffix='0/{}'.format(end_address - start_address))
-
-    read_bytes = 0
-    expected_bytes = end_address - start_address
-    while read_bytes < expected_bytes:
-        # read a chunk of data
-        chunk = serial_connection.read(1)
-        data += chunk
-        read_bytes += 1
-
-        if not VERBOSE and not DISABLE_PROGRESS_BAR:
-            printProgressBar(len(data), end_address - start_address,
-                             prefix='Reading memory:', length=50, suffix='{}/{}'.format(read_bytes, expected_bytes))
-
-    read_until(DATA_END_MESSAGE)
+    data = device.dump(start_address, end_address)
     print("Saving to file: {}".format(filename))
-    clear_serial_buffer()
-
     with open(filename, 'wb') as f:
         f.write(data)
     print_color("Done!", 'g')
 
 
-def program_device(start_address, end_address, filename):
-    file_data = []
-    read_byte = 0
-    with open(filename, 'rb') as f:
-        read_byte = f.read(1)
-        while read_byte != b'':
-            file_data.append(read_byte)
-            read_byte = f.read(1)
-
-    print("Loaded {} bytes from file".format(len(file_data)))
-    if len(file_data) > (end_address - start_address):
-        print_color(
-            "WARNING: File is larger than specified memory range, data will be truncated; continue? (y/n)", 'r')
+def load_image(start_address, end_address, filename, confirm=True):
+    # Returns the image clipped to [start_address, end_address), or None if it can't be used
+    # BIN files are placed at start_address, Intel HEX and S-record files carry their own addresses
+    try:
+        source_image = image.load(filename, base_address=start_address)
+    except ValueError as e:
+        print_color("ERROR: Unable to parse {}: {}".format(filename, e), 'r')
+        return None
+
+    print("Loaded {} bytes in {} extent(s) from file".format(len(source_image), len(source_image.extents)))
+    clipped_image = source_image.clip(start_address, end_address)
+    if len(clipped_image) < len(source_image):
+        if confirm:
+            print_color(
+                "WARNING: File is larger than specified memory range, data will be truncated; continue? (y/n)", 'r')
 
-        selection = input(": ")
-        if selection != 'y':
-            return
-    elif len(file_data) < (end_address - start_address):
-        end_address = start_address + len(file_data)
+            selection = input(": ")
+            if selection != 'y':
+                return None
+    elif clipped_image.end < end_address:
         print_color("File is smaller than specified memory range, actual end address will be {}".format(
-            hex(end_address)), 'y')
-
-    print("Start address{} -> End address: {}".format(hex(start_address), hex(end_address)))
-
-    serial_connection.write('pb {} {}\r'.format(
-        start_address, end_address).encode('utf-8'))
-    read_until(SEND_DATA_MESSAGE)
-
-    data_index = 0
-    current_address = start_address
-
-    printProgressBar(current_address, end_address,
-                     prefix='Sending bytes:', suffix='Complete', length=50)
-    while current_address < end_address:
-        # Send a chunk of 64 bytes, then wait for a . to be sent back
-        chunk = file_data[data_index:data_index+64 % len(file_data)]
-        for byte in chunk:
-            serial_connection.write(byte)
-        data_index += 64
-        current_address += 64
-        while serial_connection.read(1) != b'.':
-            pass
+            hex(clipped_image.end)), 'y')
 
-        printProgressBar(current_address, end_address,
-                         prefix='Sending bytes:', suffix='Complete', length=50)
+    return clipped_image
 
-    time.sleep(0.5)
 
-    print("Sent bytes, awaiting confirmation...")
-    read_until(ACK_MESSAGE)
+def compare_read_back(original_bytes, read_back_bytes, log=print, stats=None):
+    if original_bytes == read_back_bytes:
+        return True
 
-    print("Device acknowledged data, read-back starting...")
-    serial_connection.write('\r'.encode('utf-8'))
-    read_until(RECEIVE_DATA_MESSAGE)
-    read_back_bytes = bytearray()
-    rb_index = 0
-    printProgressBar(rb_index, end_address - start_address,
-                     prefix='Read-back:', suffix='Complete', length=50)
-    while True:
-        # Read a single byte, which is the raw data read at the current address
-        read_byte = serial_connection.read(1)
-        read_back_bytes += bytearray(read_byte)
-        rb_index += 1
-        if rb_index >= (end_address - start_address):
-            print("Read-back complete")
-            break
+    if stats is not None:
+        for address, expected, actual in stats.mismatches:
+            log("Mismatch at {}: expected {} got {}".format(hex(address), hex(expected), hex(actual)))
+        log("Diagnosis: {}".format(stats.diagnosis()))
+
+    sha1_original = hashlib.sha1(original_bytes).hexdigest()
+    sha1_read_back = hashlib.sha1(read_back_bytes).hexdigest()
+    log("Length original: {}, Length read-back: {}".format(
+        len(original_bytes), len(read_back_bytes)))
+    log("SHA1 original: {}, SHA1 read-back: {}".format(sha1_original, sha1_read_back))
+    return False
+
+
+def save_image(data_image, basename):
+    # Contiguous images are saved raw (.bin), sparse ones as Intel HEX (.hex) so the gaps (and addresses) are kept
+    # The extension matches the format written so image.load() can read the file back, returns the filename
+    if len(data_image.extents) == 1:
+        filename = basename + '.bin'
+        with open(filename, 'wb') as f:
+            f.write(data_image.extents[0].data)
+    else:
+        filename = basename + '.hex'
+        with open(filename, 'w') as f:
+            image.write_intel_hex(data_image, f)
+    return filename
 
-        printProgressBar(rb_index, end_address - start_address,
-                         prefix='Read-back:', suffix='Complete', length=50)
 
-    read_until(DATA_END_MESSAGE)
+def program_device(start_address, end_address, filename):
+    source_image = load_image(start_address, end_address, filename)
+    if source_image is None:
+        return False
 
-    print("Read-back complete, saving to file...")
-    with open('read-back.hex', 'wb') as f:
-        f.write(read_back_bytes)
+    read_back_image = image.Image()
+    matches = True
+    try:
+        # Only populated extents are sent, see KAMFDevice.program_image()
+        results = device.program_image(source_image)
+    except transfer.TransferError as e:
+        print_color("ERROR: {}".format(e), 'r')
+        return False
+    for extent, read_back_bytes, stats in sorted(results, key=lambda result: result[0].start):
+        print("Comparing read-back of {} -> {} to original file...".format(hex(extent.start), hex(extent.end)))
+        read_back_image.extents.append(image.Extent(extent.start, read_back_bytes))
+        if not compare_read_back(extent.data, read_back_bytes, stats=stats):
+            matches = False
 
-    print("Comparing read-back to original file...")
-    with open(filename, 'rb') as f:
-        original_bytes = f.read()
-    
-    clear_serial_buffer()
+    print("Read-back complete, saved to {}".format(save_image(read_back_image, 'read-back')))
 
-    if original_bytes == read_back_bytes:
+    if matches:
         print_color(
             "Read-back matches original file, device programmed successfully!", 'g')
         return True
     else:
-        sha1_original = hashlib.sha1(original_bytes).hexdigest()
-        sha1_read_back = hashlib.sha1(read_back_bytes).hexdigest()
-
         print_color(
             "Read-back does not match original file, device programming failed!", 'r')
+        return False
+
 
-        print("Length original: {}, Length read-back: {}".format(
-            len(original_bytes), len(read_back_bytes)))
-        print("SHA1 original: {}, SHA1 read-back: {}".format(sha1_original, sha1_read_back))
+def verify_device(start_address, end_address, filename):
+    source_image = load_image(start_address, end_address, filename, confirm=False)
+    if source_image is None:
         return False
 
+    matches = True
+    for extent in source_image.extents:
+        print("Verifying {} -> {}".format(hex(extent.start), hex(extent.end)))
+        read_back_bytes = device.dump(extent.start, extent.end, expected=extent.data)
+        if not compare_read_back(extent.data, read_back_bytes, stats=device.last_verify):
+            matches = False
 
+    if matches:
+        print_color("Device content matches {}".format(filename), 'g')
+    else:
+        print_color("Device content does not match {}".format(filename), 'r')
+    return matches
 
 
 def main():
-    global serial_connection, serial_port, baud_rate, VERBOSE, DISABLE_PROGRESS_BAR
+    global device, serial_port, baud_rate, memory_size, VERBOSE, DISABLE_PROGRESS_BAR
 
     argparser = argparse.ArgumentParser(
         description='KAMF - the Kinda Awful Memory Flasher')
     argparser.add_argument(
-        '-p', '--port', help='Serial port to connect to', default=serial_port)
+        '-p', '--port', help='Serial port(s) to connect to, several ports enable gang mode (all devices are driven at once)',
+        nargs='+', default=[serial_port])
     argparser.add_argument(
         '-b', '--baud', help='Baud rate to connect at', default=baud_rate)
 
@@ -362,28 +670,39 @@ def main():
         '-w', '--write', help='Write a file to the device', default=False, action='store_true')
 
     argparser.add_argument(
-        '-s', '--source', help='File to write to device', default=None)
+        '-V', '--verify', help='Compare the device against a file', default=False, action='store_true')
+
+    argparser.add_argument(
+        '-t', '--test-ram', help='Run the SRAM march test N (default: every test) on a RAM in the adapter',
+        nargs='?', const=0, default=None, type=int, metavar='N')
+
+    argparser.add_argument(
+        '-s', '--source', help='File to write to (or verify against) the device: BIN, Intel HEX (.hex) or S-record (.s19/.s28/.s37/.srec)', default=None)
     argparser.add_argument(
-        '-o', '--readoutput', help='File to send the read data to', default="read_data.hex")
+        '-o', '--readoutput', help='File to send the read data to (raw binary)', default="read_data.bin")
     argparser.add_argument(
-        '--start-address', help='Start address for read/write operations', default=0)
+        '--start-address', help='Start address for read/write operations', default=0, type=lambda x: int(x, 0))
     argparser.add_argument(
-        '--end-address', help='End address for read/write operations', default=0xffff)
+        '--end-address', help='End address (exclusive) for read/write operations (default: memory size)', default=None, type=lambda x: int(x, 0))
+    argparser.add_argument(
+        '-m', '--memory-size', help='Size of the memory in bytes', default=memory_size, type=lambda x: int(x, 0))
 
     args = argparser.parse_args()
-    serial_port = args.port
-    baud_rate = args.baud
+    serial_port = args.port[0]
+    baud_rate = int(args.baud)
     VERBOSE = args.verbose
     DISABLE_PROGRESS_BAR = args.disable_progress_bar
     signal.signal(signal.SIGINT, exit_handler)
     erase_mode = args.erase
     read_mode = args.read
     write_mode = args.write
+    verify_mode = args.verify
 
     to_write_filename = args.source
     to_read_filename = args.readoutput
     start_address = args.start_address
-    end_address = args.end_address
+    memory_size = args.memory_size
+    end_address = args.end_address if args.end_address is not None else memory_size
 
     rainbow_print("KAMF - the Kinda Awful Memory Flasher")
     rainbow_print("Developed by: Leah Cornelius")
@@ -392,17 +711,50 @@ def main():
     if VERBOSE:
 
         print("Verbose output enabled - you fool")
+
+    if len(args.port) > 1:
+        import gang
+        if not (erase_mode or read_mode or write_mode or verify_mode):
+            print_color(
+                "ERROR: Gang mode needs at least one of --erase, --read, --write or --verify, exiting...", 'r')
+            sys.exit(1)
+        source_image = None
+        if write_mode or verify_mode:
+            if to_write_filename is None:
+                print_color(
+                    "ERROR: No filename specified for write/verify operation, exiting...", 'r')
+                sys.exit(1)
+            source_image = load_image(start_address, end_address, to_write_filename, confirm=False)
+            if source_image is None:
+                sys.exit(1)
+
+        results = gang.run(args.port, baud_rate, start_address, end_address,
+                           erase=erase_mode, read_filename=to_read_filename if read_mode else None,
+                           source_image=source_image if write_mode else None,
+                           verify_image=source_image if verify_mode else None, verbose=VERBOSE)
+        sys.exit(0 if gang.report(results) else 1)
+
     print("Opening connection...")
+    device = KAMFDevice(serial_port, baud_rate, verbose=VERBOSE,
+                        show_progress=not DISABLE_PROGRESS_BAR)
     try:
-        open_port()
+        device.open()
     except serial.SerialException:
         print("ERROR: Unable to open serial port, exiting...")
         sys.exit(1)
 
-    if not handshake():
+    if not device.handshake():
         print("Handshake failed, exiting...")
         sys.exit(1)
 
+    if args.test_ram is not None:
+        print_color("Testing RAM, ensure Vpp is NOT applied", 'y')
+        if not device.test_ram(args.test_ram, end_address - start_address):
+            print_color("ERROR: RAM test failed, exiting...", 'r')
+            sys.exit(1)
+        print_color("RAM test passed", 'g')
+        sys.exit(0)
+
     if read_mode:
         if to_read_filename is None:
             print_color(
@@ -415,7 +767,7 @@ def main():
 
         dump_content(start_address, end_address, to_read_filename)
         print_color("Read complete", 'g')
-        if not erase_mode and not write_mode:
+        if not erase_mode and not write_mode and not verify_mode:
             sys.exit(0)
 
     if erase_mode:
@@ -428,7 +780,7 @@ def main():
         print_color("Erase complete", 'g')
         os.system("spd-say 'Erase complete'")
 
-        if not write_mode:
+        if not write_mode and not verify_mode:
             sys.exit(0)
 
     if write_mode:
@@ -447,6 +799,19 @@ def main():
             sys.exit(1)
         print_color("Write complete", 'g')
         os.system("spd-say 'Write complete'")
+        if not verify_mode:
+            sys.exit(0)
+
+    if verify_mode:
+        if to_write_filename is None:
+            print_color(
+                "ERROR: No filename specified for verify operation, exiting...", 'r')
+            sys.exit(1)
+
+        if not verify_device(start_address, end_address, to_write_filename):
+            print_color("ERROR: Verify failed, exiting...", 'r')
+            sys.exit(1)
+        print_color("Verify complete", 'g')
         sys.exit(0)
 
     # Loop until user exits
@@ -465,7 +830,7 @@ def main():
             start_address = hex_input(
                 "Please enter the start address (in hex) to read from (default 0x0000): ", 0)
             end_address = hex_input(
-                "Please enter the end address (in hex) to read from (default 0xFFFF): ", 0xFFFF)
+                "Please enter the end address (in hex) to read from (exclusive, default {}): ".format(hex(memory_size)), memory_size)
             filename = input(
                 "Please enter the filename to save to (default 'read.bin'): ")
             if filename == '':
@@ -483,7 +848,7 @@ def main():
             start_address = hex_input(
                 "Please enter the start address (in hex) to program from (default 0x0000): ", 0)
             end_address = hex_input(
-                "Please enter the end address (in hex) to program from (default 0xFFFF): ", 0xFFFF)
+                "Please enter the end address (in hex) to program from (exclusive, default {}): ".format(hex(memory_size)), memory_size)
             filename = input(
                 "Please enter the filename to read from (default 'corn8.bin'): ")
             if filename == '':
@@ -493,6 +858,7 @@ def main():
             raw_terminal()
         elif selection == '5':
             VERBOSE = not VERBOSE
+            device.verbose = VERBOSE
             print("Verbose output set to {}".format(VERBOSE))
         elif selection == '6':
             print("Exiting...")
@@ -503,4 +869,9 @@ def main():
 
 
 if __name__ == "__main__":
-    main()
+    try:
+        main()
+    except DeviceTimeout as e:
+        print_color("ERROR: {}, exiting...".format(e), 'r')
+        close_connection()
+        sys.exit(1)
@@ -2,7 +2,7 @@
 # It can also read he content of the memory and save it to a file
 # 3 required arguments:
 # port (string) - the path pointing to the arduino (ie /dev/ttyUSB0 etc)
-# file (string) - the path of the file you wish to flash - this must be in intel hex format
+# file (string) - the path of the file you wish to flash - Intel HEX, S-record or raw BIN (see image.py)
 # address offset (hexadecimal)- the address of the file to be treated as the first line to flash to the memory
 # Additonal optional argument:
 # output_path (string): if specified, the contents of the memory will first be read and saved to this file before writing the new file
@@ -16,7 +16,8 @@ import serial
 import sys
 import argparse
 
-from intelhex import IntelHex
+import image
+import transfer
 
 # Constants/ config
 BAUD_RATE = 9600
@@ -25,11 +26,11 @@ VERBOSE_READ = True
 SKIP_VERIFY = False
 SKIP_WRITE = False
 SKIP_ERASE = False
+BATCHED = False  # Use the scatter program / gather read commands (see transfer.py) instead of one command per byte
 
 # Global vars
 file_name = None
-file_stream = IntelHex()
-file_content = {}
+file_image = image.Image()
 
 dump_existing_values = False
 memory_dump_path = None
@@ -81,8 +82,8 @@ def printProgressBar(iteration, total, prefix='', suffix='', decimals=1, length=
 
 def create_test_pattern():
     # Create a test pattern, set the data at address 0 to address % 256
-    for i in range(0, sram_size):
-        file_stream[i] = i % 256
+    global file_image
+    file_image = image.build([(address_offset, bytes(i % 256 for i in range(0, sram_size)))])
     
 
 def read_byte(address):
@@ -197,49 +198,55 @@ def erase_memory():
 
 
 def flash_memory():
-    global file_content, address_offset
+    global file_image, address_offset
+
+    # File addresses from address_offset onwards map to the memory from address 0, gaps are skipped
+    chip_image = file_image.clip(address_offset, address_offset + sram_size).offset(-address_offset)
+    total_bytes = len(chip_image)
 
     if not SKIP_WRITE:
-        print("Flashing memory...")
-        printProgressBar(0, sram_size, prefix='Progress:',
+        print("Flashing memory ({} bytes in {} extents)...".format(total_bytes, len(chip_image.extents)))
+        printProgressBar(0, total_bytes, prefix='Progress:',
                         suffix='Complete', length=50)
-        start_write_cycle()
-        sram_address = 0
-        for address in file_content:
-            if (address < address_offset):
-                continue
-            data = file_content[address]
-            write_byte(sram_address, data)
-            sram_address += 1
-            printProgressBar(sram_address, sram_size,
-                            prefix='Progress:', suffix='Complete', length=50)
-        end_write_cycle()
+        if BATCHED:
+            transfer.scatter_program(serial_connection, list(chip_image.items()), transfer.address_bytes_for(sram_size),
+                                     lambda done, total: printProgressBar(done, total, prefix='Progress:',
+                                                                          suffix='Complete', length=50))
+        else:
+            start_write_cycle()
+            written_bytes = 0
+            for sram_address, data in chip_image.items():
+                write_byte(sram_address, data)
+                written_bytes += 1
+                printProgressBar(written_bytes, total_bytes,
+                                prefix='Progress:', suffix='Complete', length=50)
+            end_write_cycle()
         print("Memory flash complete")
     else:
         print("Skipping flash")
     
     if not SKIP_VERIFY:
         print("Verifying memory...")
-        printProgressBar(0, sram_size,
+        printProgressBar(0, total_bytes,
                          prefix='Progress:', suffix='Complete', length=50)
-        sram_address = 0
-        start_read_cycle()
-        for address in file_content:
-            if (address < address_offset):
-                continue
-            data = file_content[address]
-            read_data = read_byte(sram_address)
+        verified_bytes = 0
+        if BATCHED:
+            gathered = iter(transfer.gather_read(serial_connection, [address for address, _ in chip_image.items()],
+                                                 transfer.address_bytes_for(sram_size)))
+        else:
+            start_read_cycle()
+        for sram_address, data in chip_image.items():
+            read_data = next(gathered) if BATCHED else read_byte(sram_address)
+            verified_bytes += 1
             if (data != read_data):
                 print("Verification failed at address {}: expected {} but got {}".format(
                     hex(sram_address), hex(data), hex(read_data)))
                 write_byte(sram_address, data)
-                #address -= 1
             else:
-                printProgressBar(sram_address+1, sram_size,
+                printProgressBar(verified_bytes, total_bytes,
                                  prefix='Progress:', suffix='Complete', length=50)
-
-            sram_address += 1
-        end_read_cycle()
+        if not BATCHED:
+            end_read_cycle()
         print("Memory verification complete")
     else:
         print("Skipping verify")
@@ -256,17 +263,16 @@ def read_line():
     return serial_device_id, data
 
 def main():
-    global serial_connection, file_stream, file_content, address_offset, dump_existing_values, memory_dump_path, serial_device_id, serial_port, file_name
+    global serial_connection, file_image, address_offset, dump_existing_values, memory_dump_path, serial_device_id, serial_port, file_name
     print("Cornelius Innovations - Memory Basher V2.3")
     print("File name: {}".format(file_name))
     print("Serial Port: {}, Baudrate: {}".format(serial_port, BAUD_RATE))
 
     print("Openning file...")
-    file_stream.fromfile(file_name, format='hex')
-    file_content = file_stream.todict()
+    file_image = image.load(file_name, base_address=address_offset)
     print("File opened successfully")
-    print("File stats: {} bytes, {} lines".format(
-        len(file_content), len(file_stream)))
+    print("File stats: {} bytes, {} extents".format(
+        len(file_image), len(file_image.extents)))
 
     print("Opening serial connection...")
     try:
@@ -276,7 +282,8 @@ def main():
         serial_connection = serial.Serial(serial_port, BAUD_RATE, timeout=1)
         # Wait for a RTS signal
         serial_read_line = ""
-        while ("rtr" not in serial_read_line):
+        # Older firmware announces itself with "rtr", current KAMF firmware with "RTR"
+        while ("rtr" not in serial_read_line.lower()):
             if (serial_connection.in_waiting > 0):
                 serial_read_line = serial_connection.readline().decode("utf-8")
                 print("({}): {} ".format(serial_device_id, serial_read_line), end='')
@@ -309,10 +316,12 @@ if __name__ == "__main__":
     parser.add_argument('file_name', type=str, help='File to flash')
     parser.add_argument('address_offset', type=str, help='Address offset')
     parser.add_argument('--dump', type=str, help='Dump memory to file')
+    parser.add_argument('--size', type=lambda x: int(x, 0), default=sram_size, help='Memory size in bytes (default 0x10000)')
     parser.add_argument('--no-write', help='Disables writing to the chip (will only verify existing values)', action='store_true')
     parser.add_argument('--verbose', help='Enables verbose output', action='store_true')
     parser.add_argument('--skip-verify', help='Disables post-write verifcation', action='store_true')
     parser.add_argument('--skip-erase', help='Disables memory erase', action='store_true')
+    parser.add_argument('--batched', help='Send the data as batched scatter program / gather read transfers (needs firmware built with BULK_TRANSFER_CODE)', action='store_true')
     args = parser.parse_args()
     serial_port = args.serial_port
     file_name = args.file_name
@@ -324,6 +333,8 @@ if __name__ == "__main__":
     else:
         address_offset = int(address_offset)
 
+    sram_size = args.size
+
     if (args.dump):
         memory_dump_path = args.dump
         dump_existing_values = True
@@ -331,6 +342,7 @@ if __name__ == "__main__":
     SKIP_VERIFY = args.skip_verify
     SKIP_WRITE = args.no_write
     SKIP_ERASE = args.skip_erase
+    BATCHED = args.batched
     VERBOSE_WRITE = args.verbose
     VERBOSE_READ = args.verbose
         
@@ -0,0 +1,87 @@
+# Scatter program ('sp') and gather read ('gr') block transfers, shared by kamf.py and spflash.py
+# Mirrors firmware/src/transfer.cpp: every (address, data) pair is sent as a binary block of the address
+# (address_bytes, MSB first), the data byte and a checksum byte that makes the block sum to 0. The blocks go
+# in batches of BULK_BLOCK_COUNT and each batch is answered in one burst: a status byte, then the byte read
+# back from every address in the batch and a checksum. Patching hundreds of scattered bytes (vector tables,
+# serial numbers) costs one round trip per batch instead of one command per byte.
+
+BULK_BLOCK_COUNT = 16  # Must match BULK_BLOCK_COUNT in firmware/include/transfer.h
+TIMEOUT_STATUS = 0xFF
+SEND_DATA_MESSAGE = "SD"
+ACK_MESSAGE = "ACK"
+NACK_MESSAGE = "NCK"
+
+
+class TransferError(Exception):
+    pass
+
+
+def address_bytes_for(memory_size):
+    # ADDRESS_BYTES in firmware/include/config.h for a part of memory_size bytes (at least the 16 bit parts' 2)
+    return max(2, ((memory_size - 1).bit_length() + 7) // 8)
+
+
+def encode_blocks(pairs, address_bytes):
+    blocks = bytearray()
+    for address, data in pairs:
+        block = address.to_bytes(address_bytes, 'big') + bytes([data])
+        blocks += block + bytes([-sum(block) & 0xFF])
+    return blocks
+
+
+def read_exactly(connection, count):
+    data = connection.read(count)
+    if len(data) != count:
+        raise TransferError("Timed out after {}/{} bytes".format(len(data), count))
+    return data
+
+
+def read_line_containing(connection, messages):
+    readline = ''
+    while not any(message in readline for message in messages):
+        response = connection.readline()
+        if response == b'':
+            raise TransferError("Timed out waiting for {}".format(' or '.join(messages)))
+        readline = response.decode('utf-8', errors='replace')
+    return readline
+
+
+def run(connection, command, pairs, address_bytes, progress=None):
+    # Sends pairs ((address, data), data is ignored by 'gr') with command 'sp' or 'gr', returns the read-back bytes
+    # progress(done, total) is called after each batch
+    for address, data in pairs:
+        if address >> (8 * address_bytes) or not 0 <= data <= 0xFF:
+            raise TransferError("Can't send {} -> {} in a block".format(hex(address), hex(data)))
+    connection.write('{} {}\r'.format(command, len(pairs)).encode('utf-8'))
+    readline = read_line_containing(connection, (SEND_DATA_MESSAGE, NACK_MESSAGE, 'error'))
+    if SEND_DATA_MESSAGE not in readline:
+        # NCK, or a parse error from firmware built without BULK_TRANSFER_CODE
+        raise TransferError("Device refused '{}': {}".format(command, readline.strip()))
+    read_back = bytearray()
+    for offset in range(0, len(pairs), BULK_BLOCK_COUNT):
+        batch = pairs[offset:offset + BULK_BLOCK_COUNT]
+        connection.write(encode_blocks(batch, address_bytes))
+        status = read_exactly(connection, 1)[0]
+        if status == TIMEOUT_STATUS:
+            raise TransferError("Device timed out receiving the batch at {}".format(hex(batch[0][0])))
+        if status != 0:
+            address = batch[status - 1][0]
+            raise TransferError("Device rejected the block for {} (bad checksum or address)".format(hex(address)))
+        reply = read_exactly(connection, len(batch) + 1)
+        if sum(reply) & 0xFF != 0:
+            raise TransferError("Checksum mismatch in the reply for the batch at {}".format(hex(batch[0][0])))
+        read_back += reply[:-1]
+        if progress is not None:
+            progress(len(read_back), len(pairs))
+    if NACK_MESSAGE in read_line_containing(connection, (ACK_MESSAGE, NACK_MESSAGE)):
+        raise TransferError("Device reported a failure")
+    return read_back
+
+
+def scatter_program(connection, pairs, address_bytes, progress=None):
+    # Programs every (address, data) pair, returns the device's read-back of each address
+    return run(connection, 'sp', list(pairs), address_bytes, progress)
+
+
+def gather_read(connection, addresses, address_bytes, progress=None):
+    return run(connection, 'gr', [(address, 0) for address in addresses], address_bytes, progress)